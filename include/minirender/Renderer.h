@@ -3,6 +3,7 @@
 
 #include "Scene.h"
 #include <asl/Array2.h>
+#include <functional>
 
 namespace minirender {
 
@@ -13,15 +14,88 @@ asl::Matrix4 projectionFrustumH(float fov, float aspect, float n, float f);
 asl::Matrix4 projectionOrtho(float fov, float aspect, float n, float f);
 asl::Matrix4 projectionCV(const asl::Matrix4& K, float w, float h, float n, float f);
 
+// a triangle in view space, projected to pixel coordinates and ready to rasterize
+struct Triangle
+{
+	asl::Vec3 vertices[3];
+	asl::Vec3 normals[3];
+	asl::Vec2 texcoords[3];
+	asl::Vec2 p[3];
+	asl::Vec2 n1, n2;
+	asl::Vec2 pmin, pmax;
+	// integer edge functions of the vertices (snapped to sub-pixels), non-negative inside with the top-left fill rule:
+	// ea and eb are their steps per pixel column and row, ec their value at the center of pixel (0, 0) in sub-pixels
+	int ea[3], eb[3];
+	long long ec[3];
+	float zz[3];
+	float iz[3];
+	int state; // shading state (material)
+	int mesh;  // order of the mesh in the frame
+};
+
+// material constants resolved once per mesh for shading, and the shading kernel specialized for its flags
+struct ShadingState
+{
+	const Material* material;
+	asl::Vec3 diffuse, specular, emissive;
+	float shininess;
+	const Texture* texture;
+	int kernel;
+};
+
+// a vertex projected to pixel coordinates, with its NDC depth and -1/z (z in view space), and the clipping planes
+// it is outside of (near, far and guard band)
+struct ProjectedVertex
+{
+	asl::Vec2 p;
+	float z, iz;
+	int clip;
+};
+
+// counters of the last render, to measure rasterization efficiency
+
+struct RenderStats
+{
+	long long pixelsTested;  // pixels whose edge functions were evaluated
+	long long pixelsCovered; // pixels inside triangles (before the depth test)
+	int meshesDrawn;         // meshes painted
+	int meshesCulled;        // meshes skipped for being out of the view frustum
+	RenderStats() : pixelsTested(0), pixelsCovered(0), meshesDrawn(0), meshesCulled(0) {}
+	RenderStats& operator+=(const RenderStats& s)
+	{
+		pixelsTested += s.pixelsTested;
+		pixelsCovered += s.pixelsCovered;
+		meshesDrawn += s.meshesDrawn;
+		meshesCulled += s.meshesCulled;
+		return *this;
+	}
+};
+
+// a visible mesh while sorting them: its material, the first visible mesh with that material, and its view depth
+
+struct MeshSortKey
+{
+	const Material* material;
+	int first;
+	float depth;
+	int index;
+};
 
 class Renderer
 {
 	asl::Array2<asl::Vec3> _image;
+	asl::Array2<unsigned>  _rgba;
 	asl::Array2<float> _depth;
 	asl::Array2<asl::Vec3> _points;
 	asl::Array2<asl::Vec3> _pnormals;
+	asl::Array2<int>       _ids;
+	asl::Array2<asl::Vec3> _bary;
+	asl::Array2<float>     _sdepth; // multisampling: depth and color of each sample (sample s of row i in row i * samples + s)
+	asl::Array2<asl::Vec3> _scolor;
+	asl::Array2<int>       _sids;   // depth prepass with multisampling: triangle id of each sample
 	asl::Array<asl::Vec3> _vertices;
 	asl::Array<asl::Vec3> _normals;
+	asl::Array<ProjectedVertex> _projected;
 	asl::Matrix4 _view;
 	asl::Matrix4 _projection;
 	asl::Matrix4 _modelview;
@@ -35,7 +109,56 @@ class Renderer
 	asl::Shared<Material>  _material;
 	asl::Shared<Material>  _defmaterial;
 	asl::Array<Renderable> _renderables;
-	void clipTriangle(float z, Vertex v[3]);
+	asl::Array<ShadingState> _states;
+	asl::Array<int>        _visible;
+	asl::Array<MeshSortKey> _sortKeys;
+	asl::Array<Triangle>   _triangles;
+	asl::Array<int>        _binStart;
+	asl::Array<int>        _binItems;
+	asl::Array<RenderStats> _tileStats;
+	asl::Array<RenderStats> _viewStats;
+	asl::Array<asl::Shared<Renderer>> _viewRenderers;
+	RenderStats _stats;
+	int _threads;
+	int _meshCount;
+	int _firstBinned;
+	int _triangleBase; // id of _triangles[0] (ids count all triangles set up in the pass)
+	int _state;
+	int _samples;
+	Texture::Filter _textureFilter;
+	bool _binning;
+	bool _deferred;
+	bool _depthPrepass;
+	bool _depthOnly;
+	bool _shading;  // current pass shades pixels (false in depth-only passes)
+	bool _zEqual;   // current pass only shades pixels whose depth and triangle id were kept by a prepass
+	bool _prepass;  // current pass is a depth prepass (records the id of the triangle visible at each pixel)
+	bool _sortMeshes;
+	bool _compact;
+	bool _persp;
+	void clipTriangle(const Vertex v[3], int planes);
+	bool setupTriangle(const Vertex& a, const Vertex& b, const Vertex& c, Triangle& t);
+	bool setupEdges(Triangle& t);
+	void transformVertices(const TriMesh& mesh, int i0, int i1);
+	void paintMeshTriangle(const TriMesh& mesh, int i, bool hastexcoords);
+	void drawTriangle(const Triangle& t);
+	bool rasterize(const Triangle& t, int id, int row0, int row1, RenderStats& stats);
+	template<bool Persp, bool Multisample>
+	bool rasterizeKernel(const Triangle& t, int id, int row0, int row1, RenderStats& stats);
+	typedef void (Renderer::*ShadeKernel)(const Triangle& t, int i, int j, int n, int mask, const float* k0, const float* k1, const float* k2);
+	static const ShadeKernel shadeKernels[32];
+	template<bool Texture, bool Lighting, bool PointLight, bool Specular, bool Normals>
+	void shadeKernel(const Triangle& t, int i, int j, int n, int mask, const float* k0, const float* k1, const float* k2);
+	int shadingKernel(const Material& material) const;
+	void shade(const Triangle& t, int i, int j, int n, int mask, const float* k0, const float* k1, const float* k2);
+	void shadeDeferred();
+	void resolve();
+	void flush();
+	void cull();
+	void draw();
+	void renderViews(const asl::Array<asl::Matrix4>& views, const std::function<void(Renderer&, int)>& bind);
+	void resizeBuffers(int w, int h);
+	void useMaterial();
 	bool _lighting;
 	bool _texturing;
 	bool _lightIsPoint;
@@ -43,24 +166,62 @@ class Renderer
 public:
 	Renderer();
 	void setSize(int w, int h);
-	float aspect() const { return (float)_image.cols() / _image.rows(); }
+	float aspect() const { return (float)_depth.cols() / _depth.rows(); }
 	void setScene(asl::Shared<Scene> scene);
-	void setProjection(const asl::Matrix4& m) { _projection = m; }
+	void setProjection(const asl::Matrix4& m) { _projection = m; _persp = m(3, 3) == 0; }
 	void setView(const asl::Matrix4& m) { _view = m; }
-	void setLight(const asl::Vec3& v, bool point = false) { _light = v; _lightIsPoint = point; }
-	void setMaterial(asl::Shared<Material> material) { _material = material; }
-	void setLighting(bool on) { _lighting = on; }
-	void setTexturing(bool on) { _texturing = on; }
-	void setSaveNormals(bool on) { _saveNormals = on; }
+	void setLight(const asl::Vec3& v, bool point = false) { _light = v; _lightIsPoint = point; useMaterial(); }
+	void setMaterial(asl::Shared<Material> material) { _material = material; useMaterial(); }
+	void setLighting(bool on) { _lighting = on; useMaterial(); }
+	void setTexturing(bool on) { _texturing = on; useMaterial(); }
+	// texture filtering (default nearest, the cheapest), with the mipmap level chosen from the texture coordinate
+	// derivatives
+	void setTextureFilter(Texture::Filter filter) { _textureFilter = filter; }
+	void setSaveNormals(bool on) { _saveNormals = on; useMaterial(); }
 	void setBackground(const asl::Vec3& color) { _bgcolor = color; }
+	// threads used to rasterize (default 1, 0 = all cores); the image is split in tiles painted in parallel
+	void setThreads(int n);
+	// deferred shading: visibility (depth, triangle and barycentrics) is resolved first, then each pixel shaded once
+	// (disables multisampling)
+	void setDeferred(bool on);
+	// depth prepass: the scene is painted first to the depth buffer only, then only visible pixels are shaded (by
+	// the same triangle as without a prepass, also at equal depths)
+	void setDepthPrepass(bool on) { _depthPrepass = on; }
+	// only the depth buffer is rendered (for getDepth and getRangeImage); the image and normals are left untouched
+	void setDepthOnly(bool on) { _depthOnly = on; _shading = !on; }
+	// sort meshes by material and then front to back before painting them
+	void setSortMeshes(bool on) { _sortMeshes = on; }
+	// color is written as packed 8-bit RGBA (getImageRGBA) instead of float RGB (getImage, then empty)
+	void setCompactImage(bool on);
+	// multisample antialiasing with 1 (off), 2, 4 or 8 samples per pixel: coverage and depth are tested per sample, but
+	// pixels are shaded once per triangle, and render() resolves the samples into the image and depth buffers (the depth
+	// of a pixel is its nearest sample). Disables deferred shading
+	void setMultisample(int samples);
+	// render into caller buffers, shared with the renderer (not copied, cleared by render); their size becomes the
+	// image size. A float image disables the compact image and an RGBA one enables it
+	void setImageBuffer(const asl::Array2<asl::Vec3>& image);
+	void setImageBuffer(const asl::Array2<unsigned>& image);
+	void setDepthBuffer(const asl::Array2<float>& depth);
 	void clear();
 	void render();
+	// renders the scene from several views in parallel, one view per thread, with the settings of this renderer.
+	// The scene is collected once and shared. Each view is painted into images[i] and depths[i], which are reused
+	// if they have the image size (the images are left untouched in depth-only mode). Stats are the totals of all views
+	void renderViews(const asl::Array<asl::Matrix4>& views, asl::Array<asl::Array2<asl::Vec3>>& images,
+	                 asl::Array<asl::Array2<float>>& depths);
+	void renderViews(const asl::Array<asl::Matrix4>& views, asl::Array<asl::Array2<unsigned>>& images,
+	                 asl::Array<asl::Array2<float>>& depths);
 	void paintMesh(TriMesh* mesh, const asl::Matrix4& transform = asl::Matrix4::identity());
 	void paintTriangle(const Vertex& a, const Vertex& b, const Vertex& c, bool world = true);
-	asl::Array2<float>     getDepth() const { return _depth; }
-	asl::Array2<asl::Vec3> getImage() const;
-	asl::Array2<asl::Vec3> getRangeImage();
-	asl::Array2<asl::Vec3> getNormalsImage() const { return _pnormals; }
+	const asl::Array2<float>&     getDepth() const { return _depth; }
+	const asl::Array2<asl::Vec3>& getImage() const { return _image; }
+	// the image as 8-bit RGBA pixels (0xAABBGGRR) if compact image is enabled
+	const asl::Array2<unsigned>&  getImageRGBA() const { return _rgba; }
+	// view space points of the image pixels, in an internal buffer or in a caller one (resized if needed)
+	const asl::Array2<asl::Vec3>& getRangeImage();
+	void                          getRangeImage(asl::Array2<asl::Vec3>& points) const;
+	const asl::Array2<asl::Vec3>& getNormalsImage() const { return _pnormals; }
+	const RenderStats&            getStats() const { return _stats; }
 };
 
 }
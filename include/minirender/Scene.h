@@ -8,6 +8,8 @@
 #include <asl/Array2.h>
 #include <asl/String.h>
 #include <asl/Pointer.h>
+#include <asl/Map.h>
+#include "Texture.h"
 
 namespace minirender {
 
@@ -42,6 +44,20 @@ struct Material
 	asl::Array2<asl::Vec3> texture;
 	asl::String textureName;
 	Material();
+	// the texture prepared for filtered sampling (mipmaps). It is cached and rebuilt when the texture array is replaced
+	// or resized; invalidateTexture() must be called after modifying its pixels in place (which should not be done with
+	// a shared texture file, as other materials would see them). Rebuilding it is not thread safe
+	const Texture& getTexture() const;
+	void invalidateTexture() { _textureValid = false; _textureFile = asl::Shared<TextureFile>(); }
+	// uses a shared texture file (from loadTexture) as texture, whose prepared texture is then used instead of building
+	// one for this material. Replacing the texture array later detaches it
+	void setTexture(const asl::Shared<TextureFile>& file);
+protected:
+	asl::Shared<TextureFile> _textureFile;
+	mutable Texture _texture;
+	mutable const asl::Vec3* _texturePixels;
+	mutable int _textureRows, _textureCols;
+	mutable bool _textureValid;
 };
 
 struct Renderable
@@ -52,6 +68,8 @@ struct Renderable
 	Renderable(TriMesh* mesh, const asl::Matrix4& transform) : mesh(mesh), transform(transform) {}
 };
 
+// A node of the scene graph. A node (or mesh) can be a child of several nodes, to instance it with their transforms
+
 struct SceneNode
 {
 	bool visible;
@@ -60,6 +78,7 @@ struct SceneNode
 	SceneNode();
 	virtual ~SceneNode() {}
 	virtual void collectShapes(asl::Array<Renderable>& list, const asl::Matrix4& xform);
+	// bounding box of the subtree transformed by xform, from the cached boxes of meshes (with their transformed corners)
 	virtual BBox getBbox(const asl::Matrix4& xform = asl::Matrix4::identity()) const;
 };
 
@@ -82,16 +101,116 @@ struct TriMesh : public Shape
 	virtual void collectShapes(asl::Array<Renderable>& list, const asl::Matrix4& xform);
 	virtual BBox getBbox(const asl::Matrix4& xform = asl::Matrix4::identity()) const;
 	virtual void applyTransform();
+	// bounding box of the mesh vertices (without transform or children). It is cached and recomputed when the
+	// vertex array is replaced or resized; invalidateBbox() must be called after modifying vertices in place.
+	// Recomputing it is not thread safe (Scene::updateBvh() does it for all meshes)
+	const BBox& getLocalBbox() const;
+	void invalidateBbox() { _bboxValid = false; }
+	// merges the vertices at the same position (or, if epsilon > 0, in the same cell of a grid of that size, so vertices
+	// closer than epsilon may stay apart across a cell boundary), keeping the first of each, and remaps the indices.
+	// Normals are kept as they are, or with smoothNormals replaced by vertex normals averaging those of the triangles
+	// around them (weighted by area). Meshes of more than 2^29 vertices are left unchanged
+	void weldVertices(float epsilon = 0, bool smoothNormals = false);
 
 	TriMesh();
+protected:
+	friend struct Scene;
+	mutable BBox _bbox;
+	mutable const asl::Vec3* _bboxVertices;
+	mutable int _bboxCount;
+	mutable bool _bboxValid;
+};
+
+// a ray with an origin and a direction (not necessarily unit length)
+
+struct Ray
+{
+	asl::Vec3 origin, direction;
+	Ray() {}
+	Ray(const asl::Vec3& o, const asl::Vec3& d) : origin(o), direction(d) {}
+};
+
+// result of picking with a ray; mesh is null if nothing was hit
+
+struct PickResult
+{
+	TriMesh* mesh;
+	asl::Matrix4 transform; // world transform of the instance of the mesh hit (a mesh can be in the scene several times)
+	int triangle;    // index of the triangle in the mesh (its vertices are indices[3 * triangle + k])
+	asl::Vec3 point; // hit point in world coordinates
+	float t;         // ray parameter of the hit point (origin + t * direction)
+	PickResult() : mesh(0), transform(asl::Matrix4::identity()), triangle(-1), t(asl::infinity()) {}
+};
+
+// A bounding volume hierarchy over the world-space bounding boxes of the meshes of a scene (one mesh per leaf).
+// It can be refit when meshes move, without rebuilding it.
+
+struct Bvh
+{
+	struct Node
+	{
+		BBox box;
+		int left, right; // children (-1 in leaves)
+		int parent;
+		int item;        // mesh index in leaves
+	};
+	asl::Array<Node> nodes;
+	asl::Array<Renderable> items;
+	asl::Array<int> leaves; // leaf node of each item
+	asl::Array<BBox> local; // local box of each item mesh when it was fit
+
+	void build(const asl::Array<Renderable>& items);
+	// updates the world transform of an item and the boxes of its leaf and ancestors (also if its mesh changed)
+	void refit(int item, const asl::Matrix4& transform);
+	// appends the indices of the items whose box may be inside the frustum given by a view-projection matrix
+	void cull(const asl::Matrix4& viewproj, asl::Array<int>& visible) const;
+	PickResult pick(const Ray& ray) const;
+private:
+	int build(int* items, int n, int parent);
+	void cull(int node, const asl::Matrix4& viewproj, bool inside, asl::Array<int>& visible) const;
+	asl::Array<BBox> _boxes; // world boxes of the items while building
 };
 
+// bounding box of a box transformed by a matrix (of its 8 transformed corners)
+BBox transformBox(const BBox& box, const asl::Matrix4& m);
+
+// classifies a box against the frustum of a view-projection matrix: -1 outside, 1 inside, 0 intersecting
+int frustumTest(const BBox& box, const asl::Matrix4& viewproj);
+
 struct Scene : public SceneNode
 {
 	float ambientLight;
 	asl::Vec3 light;
 	Scene();
 	void add(const asl::Shared<SceneNode>& node) { children << node; }
+	// marks the scene as changed, for changes updateBvh() cannot see: mesh vertices modified in place without calling
+	// invalidateBbox() on the mesh
+	void invalidate() { _changed = true; }
+	// updates the BVH of the scene meshes if the scene changed: it is rebuilt if meshes were added or removed, or refit
+	// if they moved. Changes are found comparing each node with a copy of its transform and children kept from the last
+	// update (instanced nodes are compared once)
+	void updateBvh();
+	const Bvh& getBvh() const { return _bvh; }
+	// finds the nearest triangle hit by a ray in world coordinates (updating the BVH first if needed)
+	PickResult pick(const Ray& ray);
+protected:
+	// a node as seen in the last update (in depth first order), with its children from _nodeChildren[first]
+	struct NodeState
+	{
+		const SceneNode* node;
+		const TriMesh* mesh; // the node if it is a mesh
+		asl::Matrix4 transform;
+		int first, count;
+		const asl::Vec3* vertices;
+		int nvertices;
+	};
+	void saveNodes(const SceneNode* node, asl::Map<const SceneNode*, bool>& saved);
+	bool changed() const;
+	Bvh _bvh;
+	asl::Array<Renderable> _shapes;
+	asl::Array<NodeState> _nodes;
+	asl::Array<const SceneNode*> _nodeChildren;
+	bool _changed;
 };
 
 }
@@ -0,0 +1,66 @@
+#ifndef MINIRENDER_TEXTURE_H
+#define MINIRENDER_TEXTURE_H
+
+#include <asl/Array.h>
+#include <asl/Array2.h>
+#include <asl/Vec2.h>
+#include <asl/Vec3.h>
+#include <asl/String.h>
+#include <string.h>
+
+namespace minirender {
+
+// A texture prepared for sampling: a chain of mipmaps (each half the size of the previous one, down to 1x1) with
+// 8-bit RGBA texels stored in tiles of 4x4 (64 bytes, a cache line), so that nearby texels in any direction are
+// close in memory. Texture coordinates wrap around (repeat).
+
+class Texture
+{
+public:
+	// texel filtering: nearest texel or bilinear in the nearest mipmap, or trilinear (bilinear in the two nearest
+	// mipmaps, interpolated)
+	enum Filter { NEAREST, BILINEAR, TRILINEAR };
+	Texture() {}
+	Texture(const asl::Array2<asl::Vec3>& image);
+	int levels() const { return _levels.length(); }
+	int width() const { return _levels.length() > 0 ? _levels[0].w : 0; }
+	int height() const { return _levels.length() > 0 ? _levels[0].h : 0; }
+	// bytes used by the texels of all levels
+	size_t memory() const;
+	// samples the n texture coordinates (u, v) of nearby pixels sharing a level of detail (log2 of the texels per
+	// pixel, 0 or less for the full size texture) into r, g, b. Only the pixels in mask (bit i for pixel i, the first 32)
+	// are needed: the others may be left untouched
+	void sample(int n, int mask, const float* u, const float* v, float lod, Filter filter, float* r, float* g,
+	            float* b) const;
+	asl::Vec3 sample(const asl::Vec2& uv, float lod, Filter filter = TRILINEAR) const;
+	// level of detail of a pixel from the derivatives of uv along image columns and rows (log2 is approximated from
+	// the float exponent and mantissa, within 0.09, enough to choose mipmaps)
+	float lod(const asl::Vec2& dx, const asl::Vec2& dy) const
+	{
+		asl::Vec2 tx(dx.x * width(), dx.y * height()), ty(dy.x * width(), dy.y * height()); // in texels
+		float r2 = asl::max(tx.length2(), ty.length2());
+		int bits;
+		memcpy(&bits, &r2, 4);
+		return (bits - (127 << 23)) * (0.5f / (1 << 23));
+	}
+private:
+	struct Level
+	{
+		asl::Array<unsigned> texels;
+		int w, h, tiles; // size and tiles per row
+		int index(int x, int y) const { return (((y >> 2) * tiles + (x >> 2)) << 4) | ((y & 3) << 2) | (x & 3); }
+	};
+	asl::Array<Level> _levels;
+};
+
+// A texture file loaded by loadTexture, shared by all the materials using it: its image and prepared texture
+struct TextureFile
+{
+	asl::String path; // absolute path
+	asl::Array2<asl::Vec3> image;
+	Texture texture;
+	size_t memory() const { return image.rows() * image.cols() * sizeof(asl::Vec3) + texture.memory(); }
+};
+
+}
+#endif
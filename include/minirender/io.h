@@ -9,7 +9,9 @@ namespace minirender
 {
 asl::Shared<SceneNode> loadMesh(const asl::String& filename);
 
-asl::Shared<TriMesh> loadSTL(const asl::String& filename);
+// loads an STL file (binary or ASCII), which has 3 separate vertices and a normal per facet. With weld, vertices are
+// merged and indexed (see TriMesh::weldVertices), with vertex normals if smoothNormals
+asl::Shared<TriMesh> loadSTL(const asl::String& filename, bool weld = false, bool smoothNormals = false, float epsilon = 0);
 
 void saveSTL(asl::Shared<TriMesh> mesh, const asl::String& name);
 
@@ -17,8 +19,25 @@ asl::Shared<SceneNode> loadOBJ(const asl::String& filename);
 
 void savePPM(const asl::Array2<asl::Vec3>& image, const asl::String& filename);
 
+// saves an image of 8-bit RGBA pixels (0xAABBGGRR, as Renderer::getImageRGBA), ignoring alpha
+void savePPM(const asl::Array2<unsigned>& image, const asl::String& filename);
+
 asl::Array2<asl::Vec3> loadPPM(const asl::String& filename);
 
+// loads a texture image (PPM) through a process-wide cache keyed by absolute path, so that all materials and files
+// using it share one image and prepared texture (see Material::setTexture). Returns null if it cannot be loaded
+asl::Shared<TextureFile> loadTexture(const asl::String& filename);
+
+// memory budget of the texture cache in bytes (0, the default, is unlimited): when exceeded, the least recently loaded
+// textures not used by any material are dropped. Textures in use are never dropped
+void setTextureCacheBudget(size_t bytes);
+
+// bytes used by the textures in the cache
+size_t textureCacheMemory();
+
+// drops the cached textures not used by any material
+void clearTextureCache();
+
 void saveXYZ(const asl::Array2<asl::Vec3>& points, const asl::String& filename, const asl::Matrix4& m = asl::Matrix4::identity());
 
 }
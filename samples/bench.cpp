@@ -76,6 +76,15 @@ int main(int argc, char** argv)
 	float tilt = deg2rad(float(args["tilt"] | 20));
 	bool  usetex = args.has("tex");
 	bool  nolight = args.has("dark");
+	int   threads = args["threads"] | 1; // rendering threads (0 = all cores)
+	bool  deferred = args.has("deferred");
+	bool  prepass = args.has("prepass");
+	bool  depthonly = args.has("depthonly");
+	bool  sortmeshes = args.has("sort");
+	bool  compact = args.has("compact"); // 8-bit RGBA image
+	bool  batch = args.has("batch");     // all frames rendered as views in parallel with renderViews
+	int   msaa = args["msaa"] | 1;       // samples per pixel (1, 2, 4 or 8)
+	int   filter = args["filter"] | 0;   // texture filter (0 nearest, 1 bilinear, 2 trilinear)
 
 	bool saving = args.has("save");
 
@@ -108,7 +117,15 @@ int main(int argc, char** argv)
 	renderer.setProjection(projectionFrustum(fov, renderer.aspect(), 10, 7000));
 	renderer.setLighting(!nolight);
 	renderer.setTexturing(usetex);
+	renderer.setTextureFilter((Texture::Filter)filter);
 	renderer.setSaveNormals(false);
+	renderer.setThreads(threads);
+	renderer.setDeferred(deferred);
+	renderer.setDepthPrepass(prepass);
+	renderer.setDepthOnly(depthonly);
+	renderer.setSortMeshes(sortmeshes);
+	renderer.setCompactImage(compact);
+	renderer.setMultisample(msaa);
 
 	Array<double> times;
 
@@ -118,7 +135,33 @@ int main(int argc, char** argv)
 
 	double t0 = now();
 
-	for (float i = 0; i < n; i++)
+	if (batch)
+	{
+		Array<Matrix4> views;
+		for (int i = 0; i < n; i++)
+		{
+			rz += wz * 0.1f;
+			rx += wx * 0.1f;
+			views << Matrix4::translate(0, 0, -d) * Matrix4::rotateX(rx) * Matrix4::rotateZ(rz);
+		}
+		Array<Array2<float>> depths;
+		if (compact)
+		{
+			Array<Array2<unsigned>> images;
+			renderer.renderViews(views, images, depths);
+			for (int i = 0; saving && i < n; i++)
+				savePPM(images[i], String::f("bench%04i.ppm", i));
+		}
+		else
+		{
+			Array<Array2<Vec3>> images;
+			renderer.renderViews(views, images, depths);
+			for (int i = 0; saving && i < n; i++)
+				savePPM(images[i], String::f("bench%04i.ppm", i));
+		}
+	}
+
+	for (float i = 0; !batch && i < n; i++)
 	{
 		double t = now();
 		float  dt = 0.1f;
@@ -132,7 +175,12 @@ int main(int argc, char** argv)
 		renderer.render();
 
 		if (saving)
-			savePPM(renderer.getImage(), String::f("bench%04i.ppm", (int)i));
+		{
+			if (compact)
+				savePPM(renderer.getImageRGBA(), String::f("bench%04i.ppm", (int)i));
+			else
+				savePPM(renderer.getImage(), String::f("bench%04i.ppm", (int)i));
+		}
 
 		double ta = now();
 
@@ -141,7 +189,11 @@ int main(int argc, char** argv)
 
 	double t6 = now();
 
-	printf("t = %.3f (t frame = %.3f)\n", t6 - t2, (t6 - t2) / n);
+	printf("t = %.3f (t frame = %.3f, %.1f frames/s)\n", t6 - t2, (t6 - t2) / n, n / (t6 - t2));
+
+	const RenderStats& stats = renderer.getStats();
+	printf("pixels tested = %lld, covered = %lld\n", stats.pixelsTested, stats.pixelsCovered);
+	printf("meshes drawn = %i, culled = %i\n", stats.meshesDrawn, stats.meshesCulled);
 
 	return 0;
 }
@@ -0,0 +1,223 @@
+#include <minirender/Renderer.h>
+#include <minirender/io.h>
+#include <minirender/primitives.h>
+#include <asl/File.h>
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+using namespace asl;
+using namespace minirender;
+
+// checks of behavior not visible in rendered images (run by ctest). Prints each check and returns non-zero if any fails
+
+int failures = 0;
+
+// heap allocations made by operator new, counted to check that rendering does not allocate
+
+std::atomic<long> allocations(0);
+
+void* operator new(size_t size)
+{
+	allocations++;
+	if (void* p = malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void check(bool ok, const char* what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+	if (!ok)
+		failures++;
+}
+
+TriMesh* firstMesh(SceneNode* node)
+{
+	if (TriMesh* mesh = dynamic_cast<TriMesh*>(node))
+		return mesh;
+	for (auto& child : node->children)
+		if (TriMesh* mesh = firstMesh(&*child))
+			return mesh;
+	return 0;
+}
+
+// malformed numeric attributes are skipped, not parsed forever
+
+void checkMalformedX3D()
+{
+	String filename = "minirender-check.x3d";
+	{
+		File file(filename, File::WRITE);
+		file << String("<X3D><Scene><Shape><Appearance><Material diffuseColor=\"1 / 0.5 x 0.25\"/></Appearance>"
+		               "<IndexedFaceSet coordIndex=\"0 1 2 / -1\"><Coordinate point=\"0 0 0, 1 0 0 / 0 1 0\"/>"
+		               "</IndexedFaceSet></Shape></Scene></X3D>");
+	}
+	Shared<SceneNode> node = loadMesh(filename);
+	TriMesh* mesh = node ? firstMesh(&*node) : 0;
+	check(mesh && mesh->indices.length() == 3 && mesh->vertices.length() == 3, "malformed X3D coordinates skipped");
+	check(mesh && mesh->material->diffuse == Vec3(1, 0.5f, 0.25f), "malformed X3D color skipped");
+}
+
+// different appearances and geometries using the same Material and Coordinate nodes share them, also with the USE
+// before the DEF
+
+void checkX3DSharedNodes()
+{
+	String filename = "minirender-check.x3d";
+	{
+		File file(filename, File::WRITE);
+		file << String("<X3D><Scene>"
+		               "<Shape><Appearance><Material USE=\"M\"/></Appearance>"
+		               "<IndexedFaceSet coordIndex=\"0 1 2 -1\"><Coordinate USE=\"C\"/></IndexedFaceSet></Shape>"
+		               "<Shape><Appearance><Material DEF=\"M\" diffuseColor=\"1 0 0\"/></Appearance>"
+		               "<IndexedFaceSet coordIndex=\"0 2 3 -1\"><Coordinate DEF=\"C\" point=\"0 0 0 1 0 0 1 1 0 0 1 0\"/>"
+		               "</IndexedFaceSet></Shape></Scene></X3D>");
+	}
+	Shared<SceneNode> node = loadMesh(filename);
+	bool     two = node && node->children.length() == 2;
+	TriMesh* a = two ? firstMesh(&*node->children[0]) : 0;
+	TriMesh* b = two ? firstMesh(&*node->children[1]) : 0;
+	check(a && b && a->material == b->material && a->material->diffuse == Vec3(1, 0, 0), "X3D Material DEF shared");
+	check(a && b && a->vertices.length() == 4 && &a->vertices[0] == &b->vertices[0], "X3D Coordinate DEF shared");
+}
+
+// a Transform used before its DEF is one node, and a USE inside its own DEF is skipped
+
+void checkX3DUseBeforeDef()
+{
+	String filename = "minirender-check.x3d";
+	{
+		File file(filename, File::WRITE);
+		file << String("<X3D><Scene><Transform USE=\"T\"/>"
+		               "<Transform DEF=\"T\"><Shape><IndexedFaceSet coordIndex=\"0 1 2 -1\">"
+		               "<Coordinate point=\"0 0 0 1 0 0 0 1 0\"/></IndexedFaceSet></Shape><Transform USE=\"T\"/></Transform>"
+		               "</Scene></X3D>");
+	}
+	Shared<SceneNode> node = loadMesh(filename);
+	bool two = node && node->children.length() == 2;
+	check(two && node->children[0] == node->children[1], "X3D Transform USE before DEF shared");
+	check(two && node->children[0]->children.length() == 1, "X3D Transform USE inside its DEF skipped");
+}
+
+// welding an STL with zero facet normals (as many exporters write) gives outward smooth normals
+
+void checkWeldNormals()
+{
+	String          filename = "minirender-check.stl";
+	Shared<TriMesh> cube = createCube(2);
+	{
+		File file(filename, File::WRITE);
+		file << String::repeat(' ', 80) << cube->indices.length() / 3;
+		for (int i = 0; i < cube->indices.length(); i += 3)
+		{
+			file << 0.0f << 0.0f << 0.0f;
+			for (int k = 0; k < 3; k++)
+			{
+				Vec3 p = cube->vertices[cube->indices[i + k]];
+				file << p.x << p.y << p.z;
+			}
+			file.write("\0\0", 2);
+		}
+	}
+	Shared<TriMesh> mesh = loadSTL(filename, true, true);
+	int outward = 0;
+	for (int i = 0; mesh && i < mesh->vertices.length(); i++)
+		if (mesh->normals[i] * mesh->vertices[i] > 0)
+			outward++;
+	check(mesh && mesh->vertices.length() == 8 && outward == 8, "welded cube normals point outward");
+}
+
+// the BVH follows transforms and children changed directly on the nodes, without invalidating the scene
+
+void checkSceneChanges()
+{
+	Shared<Scene> scene = new Scene();
+	Shared<SceneNode> group = new SceneNode();
+	Shared<TriMesh> cube = createCube(1.0f);
+	group->children << cube;
+	scene->add(group);
+	Ray ray(Vec3(0, 0, 10), Vec3(0, 0, -1));
+	check(scene->pick(ray).mesh == &*cube, "pick before changes");
+	cube->transform = Matrix4::translate(5, 0, 0);
+	check(scene->pick(ray).mesh == 0, "pick after moving a mesh");
+	group->transform = Matrix4::translate(-5, 0, 0);
+	check(scene->pick(ray).mesh == &*cube, "pick after moving its parent");
+	Shared<TriMesh> cube2 = createCube(1.0f);
+	cube2->transform = Matrix4::translate(5, 0, 2);
+	group->children << cube2;
+	check(scene->pick(ray).mesh == &*cube2, "pick after adding a child");
+}
+
+// once buffers are warm, rendering frames into caller buffers makes no heap allocations, also with several views
+
+void checkSteadyStateAllocations()
+{
+	Shared<Scene> scene = new Scene();
+	for (int i = 0; i < 4; i++)
+	{
+		Shared<TriMesh> shape = i % 2 ? createSphere(1.0f) : createCube(1.5f);
+		shape->transform = Matrix4::translate(float(i) * 3 - 4.5f, 0, 0);
+		scene->add(shape);
+	}
+	Array2<Vec3>  image(120, 160);
+	Array2<float> depth(120, 160);
+	Renderer      renderer;
+	renderer.setScene(scene);
+	renderer.setImageBuffer(image);
+	renderer.setDepthBuffer(depth);
+	renderer.setProjection(projectionFrustum(deg2rad(40.0f), renderer.aspect(), 1, 100));
+	renderer.setLight(Vec3(-0.4f, 0.6f, 1.0f));
+
+	renderer.setThreads(3);
+
+	// the same views are rendered twice: the first pass sizes the buffers for them, the second is counted
+	long counted = 0;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		counted = allocations;
+		for (int frame = 0; frame < 6; frame++)
+		{
+			renderer.setView(Matrix4::translate(0, 0, -15) * Matrix4::rotateY(0.3f * frame));
+			renderer.render();
+		}
+	}
+	counted = allocations - counted;
+	check(counted == 0, "no allocations in steady-state frames");
+
+	// the same for 8 cameras rendered in parallel into caller buffers, and their range images
+	Array<Matrix4>       views;
+	Array<Array2<Vec3>>  images;
+	Array<Array2<float>> depths;
+	Array2<Vec3>         points;
+	for (int i = 0; i < 8; i++)
+		views << Matrix4::translate(0, 0, -15) * Matrix4::rotateY(0.3f * i);
+	for (int pass = 0; pass < 2; pass++)
+	{
+		counted = allocations;
+		for (int frame = 0; frame < 3; frame++)
+		{
+			renderer.renderViews(views, images, depths);
+			renderer.getRangeImage(points);
+		}
+	}
+	counted = allocations - counted;
+	check(counted == 0, "no allocations in steady-state renderViews and range images");
+}
+
+int main()
+{
+	checkMalformedX3D();
+	checkX3DSharedNodes();
+	checkX3DUseBeforeDef();
+	checkWeldNormals();
+	checkSceneChanges();
+	checkSteadyStateAllocations();
+
+	return failures > 0 ? 1 : 0;
+}
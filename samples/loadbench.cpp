@@ -0,0 +1,74 @@
+#include <minirender/Scene.h>
+#include <minirender/io.h>
+#include <asl/CmdArgs.h>
+#include <asl/File.h>
+#include <asl/Path.h>
+
+using namespace asl;
+using namespace minirender;
+
+// loads a model (STL, OBJ or X3D) several times and prints the load time and throughput
+
+void countShapes(SceneNode* node, int& vertices, int& triangles, int& meshes)
+{
+	if (TriMesh* mesh = dynamic_cast<TriMesh*>(node))
+	{
+		vertices += mesh->vertices.length();
+		triangles += mesh->indices.length() / 3;
+		meshes++;
+	}
+	for (auto& child : node->children)
+		countShapes(&*child, vertices, triangles, meshes);
+}
+
+int main(int argc, char* argv[])
+{
+	CmdArgs args(argc, argv);
+
+	int  n = args["n"] | 5;       // number of loads
+	bool weld = args.has("weld"); // weld STL vertices
+
+	if (args.length() == 0)
+	{
+		printf("minirender-loadbench [-n <loads>] [-weld!] file\n");
+		return 0;
+	}
+
+	String filename = args[0];
+	double size = (double)File(filename).size();
+	double best = 1e10, total = 0;
+	int vertices = 0, triangles = 0, meshes = 0;
+
+	for (int i = 0; i < n; i++)
+	{
+		double t1 = now();
+		Shared<SceneNode> node;
+		if (Path(filename).hasExtension("stl"))
+		{
+			Shared<TriMesh> mesh = loadSTL(filename, weld);
+			if (mesh)
+			{
+				node = new SceneNode;
+				node->children << mesh;
+			}
+		}
+		else
+			node = loadMesh(filename);
+		double t = now() - t1;
+
+		if (!node)
+		{
+			printf("Cannot load model\n");
+			return 1;
+		}
+		best = min(best, t);
+		total += t;
+		vertices = triangles = meshes = 0;
+		countShapes(&*node, vertices, triangles, meshes);
+	}
+
+	printf("%i meshes, %i vertices, %i triangles\n", meshes, vertices, triangles);
+	printf("load t = %.3f s (best %.3f s, %.1f MB/s)\n", total / n, best, size / best / 1e6);
+
+	return 0;
+}
@@ -51,6 +51,9 @@ int main(int argc, char* argv[])
 	float fov = deg2rad(35.f);
 	float yaw = deg2rad(float(args["yaw"] | 0));
 	float tilt = deg2rad(float(args["tilt"] | 20));
+	int threads = args["threads"] | 1;          // rendering threads (0 = all cores)
+	bool deferred = args.has("deferred");       // shade each visible pixel once
+	int msaa = args["msaa"] | 1;                // antialiasing samples per pixel
 	Vec3 bg = args["bgcolor"].split(',').resize(3).with<float>().ptr();
 
 	bg /= 255;
@@ -71,9 +74,12 @@ int main(int argc, char* argv[])
 			" -rx <float> angular speed around X in degrees/s\n"
 			" -rz <float> angular speed around Z in degrees/s\n"
 			" -d <float> camera distance to origin (default: automatic to fit scene)\n"
-			" -bgcolor <int,int,int> RGB color of background\n\n"
+			" -bgcolor <int,int,int> RGB color of background\n"
+			" -threads <int> number of rendering threads (0: all cores, default: 1)\n\n"
 			" -console! render to the console\n"
 			" -oldconsole! support old consoles with only 256 colors\n"
+			" -deferred! use deferred shading (each visible pixel is shaded once)\n"
+			" -msaa <int> antialiasing samples per pixel (1, 2, 4 or 8, default: 1)\n"
 		    " -yup! make Y up (typical in X3D)\n" 
 		);
 		return 0;
@@ -128,6 +134,9 @@ int main(int argc, char* argv[])
 	Renderer renderer;
 
 	renderer.setBackground(bg);
+	renderer.setThreads(threads);
+	renderer.setDeferred(deferred);
+	renderer.setMultisample(msaa);
 	renderer.setLight(Vec3(-0.3f, 0.55f, 1));
 	renderer.setScene(scene);
 	renderer.setSize(sizew, sizeh);
@@ -1,15 +1,43 @@
 #include "minirender/Renderer.h"
+#include "parallel.h"
+#include "simd.h"
 #include <asl/Matrix3.h>
 
-#define PREMULT
-#define FAST_LIGHT
-#define POINTLIGHT
+#define TILE_ROWS 16
+#define BLOCK_SIZE 8
+#define TRIANGLE_BATCH 65536
+#define VERTEX_BATCH 4096
+#define SUBPIXEL_BITS 8
+#define MAX_COORD 65536.f // pixel coordinates the integer edge functions can hold (clipping keeps them much smaller)
+#define GUARD_BAND 4.0f // x and y limits of clipping in NDC (the image is [-1, 1]), triangles within it are not clipped
+#define MAX_SAMPLES 8
 
 using namespace asl;
 
 namespace minirender {
 
 
+// a color as 8-bit RGBA (0xAABBGGRR), with the same rounding as savePPM
+
+inline unsigned packRGBA(float r, float g, float b)
+{
+	return (unsigned)(byte)clamp(r * 255.0f, 0.0f, 255.0f) | ((unsigned)(byte)clamp(g * 255.0f, 0.0f, 255.0f) << 8) |
+	       ((unsigned)(byte)clamp(b * 255.0f, 0.0f, 255.0f) << 16) | 0xff000000u;
+}
+
+// sample positions of multisampling (x, y in sub-pixels from the pixel center), rotated grids spread over the pixel
+
+static const int* sampleOffsets(int samples)
+{
+	static const int s = (1 << SUBPIXEL_BITS) / 16;
+	static const int offsets2[] = { 4 * s, 4 * s, -4 * s, -4 * s };
+	static const int offsets4[] = { -2 * s, -6 * s, 6 * s, -2 * s, -6 * s, 2 * s, 2 * s, 6 * s };
+	static const int offsets8[] = { 1 * s, -3 * s, -1 * s, 3 * s, 5 * s, 1 * s, -3 * s, -5 * s,
+	                                -5 * s, 5 * s, -7 * s, -1 * s, 3 * s, 7 * s, 7 * s, -7 * s };
+	static const int offsets1[] = { 0, 0 };
+	return samples == 8 ? offsets8 : samples == 4 ? offsets4 : samples == 2 ? offsets2 : offsets1;
+}
+
 inline Vec3 htransform(const Matrix4& m, const Vec3& p)
 {
 	float iw = 1 / (m(3, 0) * p.x + m(3, 1) * p.y + m(3, 2) * p.z + m(3, 3));
@@ -84,8 +112,7 @@ Matrix4 projectionOrtho(float fov, float aspect, float n, float f)
 
 Renderer::Renderer()
 {
-	setSize(800, 600);
-	_projection = projectionOrtho(-40, 40, -30, 30, 50, 120);
+	setProjection(projectionOrtho(-40, 40, -30, 30, 50, 120));
 	_light = Vec3(-0.15f, 0.6f, 1).normalized();
 	_ambient = 0.1f;
 	_defmaterial = new Material();
@@ -93,16 +120,88 @@ Renderer::Renderer()
 	_scene = nullptr;
 	_lighting = true;
 	_texturing = true;
+	_saveNormals = false;
 	_bgcolor = Vec3(0, 0, 0);
 	_lightIsPoint = false;
+	_threads = 1;
+	_meshCount = 0;
+	_firstBinned = 0;
+	_triangleBase = 0;
+	_binning = false;
+	_deferred = false;
+	_sortMeshes = false;
+	_depthPrepass = false;
+	_depthOnly = false;
+	_shading = true;
+	_zEqual = false;
+	_prepass = false;
+	_compact = false;
+	_samples = 1;
+	_textureFilter = Texture::NEAREST;
+	setSize(800, 600);
+}
+
+void Renderer::setThreads(int n)
+{
+	_threads = (n > 0) ? n : hardwareThreads();
 }
 
 void Renderer::setSize(int w, int h)
 {
-	_image.resize(h, w);
+	resizeBuffers(w, h);
+	clear();
+}
+
+void Renderer::resizeBuffers(int w, int h)
+{
+	bool msaa = _samples > 1; // (pixels are shaded to the float image, also when compact, then copied to samples)
 	_depth.resize(h, w);
 	_pnormals.resize(h, w);
-	clear();
+	_image.resize(_compact && !msaa ? 0 : h, _compact && !msaa ? 0 : w);
+	_rgba.resize(_compact ? h : 0, _compact ? w : 0);
+	_sdepth.resize(msaa ? h * _samples : 0, msaa ? w : 0);
+	_scolor.resize(msaa ? h * _samples : 0, msaa ? w : 0);
+}
+
+void Renderer::setDeferred(bool on)
+{
+	_deferred = on;
+	if (on && _samples > 1)
+		setMultisample(1);
+}
+
+void Renderer::setMultisample(int samples)
+{
+	_samples = samples >= 8 ? 8 : samples >= 4 ? 4 : samples >= 2 ? 2 : 1;
+	if (_samples > 1)
+		_deferred = false;
+	setSize(_depth.cols(), _depth.rows());
+}
+
+void Renderer::setCompactImage(bool on)
+{
+	_compact = on;
+	setSize(_depth.cols(), _depth.rows());
+}
+
+void Renderer::setImageBuffer(const Array2<Vec3>& image)
+{
+	_image = image;
+	_compact = false;
+	resizeBuffers(image.cols(), image.rows());
+}
+
+void Renderer::setImageBuffer(const Array2<unsigned>& image)
+{
+	_rgba = image;
+	_compact = true;
+	resizeBuffers(image.cols(), image.rows());
+}
+
+void Renderer::setDepthBuffer(const Array2<float>& depth)
+{
+	_depth = depth;
+	resizeBuffers(depth.cols(), depth.rows());
 }
 
 void Renderer::setScene(Shared<Scene> scene)
@@ -112,207 +211,862 @@ void Renderer::setScene(Shared<Scene> scene)
 
 void Renderer::clear()
 {
-	_image.set(_bgcolor);
 	_depth.set(1e11f);
+	_sdepth.set(1e11f);
+	_states.clear();
+	useMaterial();
+	if (_depthOnly)
+		return;
+	if (_samples > 1)
+		_scolor.set(_bgcolor);
+	else if (_compact)
+		_rgba.set(packRGBA(_bgcolor.x, _bgcolor.y, _bgcolor.z));
+	else
+		_image.set(_bgcolor);
 	if (_saveNormals)
 		_pnormals.set(Vec3(0, 0, 1));
+	if (_deferred)
+	{
+		_ids.resize(_depth.rows(), _depth.cols());
+		_bary.resize(_depth.rows(), _depth.cols());
+		_ids.set(-1);
+	}
+	else if (_depthPrepass) // (no need to reset: the prepass writes the id wherever it writes the depth)
+	{
+		_ids.resize(_samples > 1 ? 0 : _depth.rows(), _samples > 1 ? 0 : _depth.cols());
+		_sids.resize(_sdepth.rows(), _sdepth.cols());
+	}
 }
 
-inline Vertex clip(float z, const Vertex& v1, const Vertex& v2)
+// signed distance of a point in clip space to clipping plane i (inside if >= 0): near, far, and the guard band
+// left, right, bottom and top
+
+inline float clipDistance(const Vec4& c, int i)
+{
+	switch (i)
+	{
+	case 0: return c.w + c.z;
+	case 1: return c.w - c.z;
+	case 2: return GUARD_BAND * c.w + c.x;
+	case 3: return GUARD_BAND * c.w - c.x;
+	case 4: return GUARD_BAND * c.w + c.y;
+	default: return GUARD_BAND * c.w - c.y;
+	}
+}
+
+// the planes a point in clip space is outside of
+
+inline int clipCode(const Vec4& c)
+{
+	int code = 0;
+	for (int i = 0; i < 6; i++)
+		if (clipDistance(c, i) < 0)
+			code |= 1 << i;
+	return code;
+}
+
+// a polygon vertex while clipping: view space attributes and clip coordinates
+
+struct ClipVertex
 {
-	float k = (fabs(v2.position.z - v1.position.z) < 1e-6f) ? 0.5f : (z - v1.position.z) / (v2.position.z - v1.position.z);
 	Vertex v;
-	v.position = k * v2.position + (1 - k) * v1.position;
-	v.normal = k * v2.normal + (1 - k) * v1.normal;
-	v.uv = k * v2.uv + (1 - k) * v1.uv;
+	Vec4 c;
+};
+
+inline ClipVertex mix(const ClipVertex& a, const ClipVertex& b, float k)
+{
+	ClipVertex v;
+	v.v.position = a.v.position + (b.v.position - a.v.position) * k;
+	v.v.normal = a.v.normal + (b.v.normal - a.v.normal) * k;
+	v.v.uv = a.v.uv + (b.v.uv - a.v.uv) * k;
+	v.c = a.c + (b.c - a.c) * k;
 	return v;
 }
 
-void Renderer::clipTriangle(float z, Vertex v[3])
+// clips a triangle in view space against the given planes (Sutherland-Hodgman, in clip space so all attributes are
+// interpolated linearly), and paints the resulting convex polygon as a fan of triangles
+
+void Renderer::clipTriangle(const Vertex v[3], int planes)
 {
-	if (v[0].position.z > z && v[1].position.z > z && v[2].position.z > z)
-		return;
+	ClipVertex polys[2][9]; // each plane adds at most one vertex
+	ClipVertex* poly = polys[0];
+	ClipVertex* next = polys[1];
+	int n = 3;
 
-	while (v[0].position.z < v[1].position.z || v[0].position.z < v[2].position.z)
+	for (int k = 0; k < 3; k++)
 	{
-		swap(v[0], v[1]);
-		swap(v[0], v[2]);
+		poly[k].v = v[k];
+		poly[k].c = _projection * Vec4(v[k].position, 1.0f);
 	}
 
-	if (v[1].position.z > z)
+	for (int i = 0; i < 6 && n >= 3; i++)
 	{
-		Vertex v02 = clip(z, v[0], v[2]);
-		Vertex v12 = clip(z, v[1], v[2]);
-		paintTriangle(v02, v12, v[2], false);
+		if (!(planes & (1 << i)))
+			continue;
+		int m = 0;
+		for (int k = 0; k < n; k++)
+		{
+			const ClipVertex& a = poly[k];
+			const ClipVertex& b = poly[k + 1 < n ? k + 1 : 0];
+			float da = clipDistance(a.c, i), db = clipDistance(b.c, i);
+			if (da >= 0)
+				next[m++] = a;
+			if ((da >= 0) != (db >= 0))
+				next[m++] = mix(a, b, da / (da - db));
+		}
+		swap(poly, next);
+		n = m;
 	}
-	else if (v[2].position.z > z)
+
+	for (int k = 1; k + 1 < n; k++)
 	{
-		Vertex v01 = clip(z, v[0], v[1]);
-		Vertex v12 = clip(z, v[1], v[2]);
-		paintTriangle(v01, v[1], v12, false);
+		Triangle t;
+		if (setupTriangle(poly[0].v, poly[k].v, poly[k + 1].v, t))
+			drawTriangle(t);
 	}
-	else
+}
+
+void Renderer::paintTriangle(const Vertex& v0, const Vertex& v1, const Vertex& v2, bool world)
+{
+	if (world)
 	{
-		Vertex v01 = clip(z, v[0], v[1]);
-		Vertex v02 = clip(z, v[0], v[2]);
-		paintTriangle(v01, v[1], v[2], false);
-		paintTriangle(v01, v[2], v02, false);
+		int c0 = clipCode(_projection * Vec4(v0.position, 1.0f));
+		int c1 = clipCode(_projection * Vec4(v1.position, 1.0f));
+		int c2 = clipCode(_projection * Vec4(v2.position, 1.0f));
+		if (c0 & c1 & c2) // outside one of the planes
+			return;
+		if (c0 | c1 | c2)
+		{
+			Vertex v[3] = { v0, v1, v2 };
+			clipTriangle(v, c0 | c1 | c2);
+			return;
+		}
 	}
+
+	Triangle t;
+
+	if (setupTriangle(v0, v1, v2, t))
+		drawTriangle(t);
 }
 
-void Renderer::paintTriangle(const Vertex& v0, const Vertex& v1, const Vertex& v2, bool world)
+// sets up triangle i of a mesh (that is inside all clipping planes) from the projected vertices of paintMesh
+
+void Renderer::paintMeshTriangle(const TriMesh& mesh, int i, bool hastexcoords)
 {
-	Vec3 vertices[3] = { v0.position, v1.position, v2.position };
-	Vec3 normals[3] = { v0.normal, v1.normal, v2.normal };
-	Vec2 texcoords[3] = { v0.uv, v1.uv, v2.uv };
+	const int* index = &mesh.indices[i];
+	Triangle t;
 
-	if (world && (vertices[0].z > _znear || vertices[1].z > _znear || vertices[2].z > _znear))
+	for (int k = 0; k < 3; k++)
 	{
-		if (vertices[0].z > _znear && vertices[1].z > _znear && vertices[2].z > _znear)
-			return;
+		const ProjectedVertex& v = _projected[index[k]];
+		t.p[k] = v.p;
+		t.zz[k] = v.z;
+		t.iz[k] = v.iz;
+	}
 
-		Vertex verts[3] = { v0, v1, v2 };
-		clipTriangle(_znear, verts);
+	if (!setupEdges(t))
 		return;
-	}
 
-	float w = (float)_image.cols(), h = (float)_image.rows();
+	for (int k = 0; k < 3; k++)
+		t.vertices[k] = _vertices[index[k]];
+
+	if (_shading)
+	{
+		bool normals = _normals.length() > 0;
+		for (int k = 0; k < 3; k++)
+		{
+			if (normals)
+				t.normals[k] = _normals[mesh.normalsI[i + k]];
+			t.texcoords[k] = hastexcoords ? mesh.texcoords[mesh.texcoordsI[i + k]] : Vec2(0, 0);
+		}
+	}
 
-	Vec3 ndc[3];
-	Vec2 p[3];
-	Vec2 pmin(1e30f, 1e30f);
-	Vec2 pmax(-1e30f, -1e30f);
+	drawTriangle(t);
+}
 
-	for (int i = 0; i < 3; i++)
+void Renderer::drawTriangle(const Triangle& t)
+{
+	if (_binning)
 	{
-		ndc[i] = htransform(_projection, vertices[i]);
+		_triangles << t;
+		if (_triangles.length() - _firstBinned >= TRIANGLE_BATCH)
+			flush();
 	}
+	else if (_deferred && _shading)
+	{
+		_triangles << t;
+		if (!rasterize(t, _triangles.length() - 1, 0, _depth.rows() - 1, _stats))
+			_triangles.removeLast(); // completely hidden so far
+	}
+	else
+		rasterize(t, _triangleBase++, 0, _depth.rows() - 1, _stats);
+}
 
-	Matrix3 topx(w / 2, 0, w / 2, 0, -h / 2, h / 2);
+bool Renderer::setupTriangle(const Vertex& v0, const Vertex& v1, const Vertex& v2, Triangle& t)
+{
+	Vec3* vertices = t.vertices;
+	vertices[0] = v0.position;
+	vertices[1] = v1.position;
+	vertices[2] = v2.position;
+	t.normals[0] = v0.normal;
+	t.normals[1] = v1.normal;
+	t.normals[2] = v2.normal;
+	t.texcoords[0] = v0.uv;
+	t.texcoords[1] = v1.uv;
+	t.texcoords[2] = v2.uv;
+
+	float w = (float)_depth.cols(), h = (float)_depth.rows();
 
 	for (int i = 0; i < 3; i++) // pixel coords
 	{
-		p[i].x = (1 + ndc[i].x) * (w / 2);
-		p[i].y = (1 - ndc[i].y) * (h / 2);
-		//p[i] = topx * ndc[i].xy();
-		pmin = min(pmin, p[i]);
-		pmax = max(pmax, p[i]);
+		Vec3 ndc = htransform(_projection, vertices[i]);
+		t.p[i].x = (1 + ndc.x) * (w / 2);
+		t.p[i].y = (1 - ndc.y) * (h / 2);
+		t.zz[i] = ndc.z;
+		t.iz[i] = -1 / vertices[i].z;
 	}
 
+	return setupEdges(t);
+}
+
+// computes the pixel bounds and edge functions of a triangle from its pixel coordinates, culling it if out of
+// the image or back facing. Vertices are snapped to a grid of 1/2^SUBPIXEL_BITS pixels and coverage is decided with
+// exact integer edge functions, so pixels on an edge shared by two triangles are painted by exactly one of them
+
+bool Renderer::setupEdges(Triangle& t)
+{
+	float w = (float)_depth.cols(), h = (float)_depth.rows();
+
+	Vec2* p = t.p;
+	Vec2 pmin = min(min(p[0], p[1]), p[2]);
+	Vec2 pmax = max(max(p[0], p[1]), p[2]);
+
 	if (pmax.x < 0 || pmax.y < 0 || pmin.x > w || pmin.y > h)
-		return;
+		return false;
 
-	float a = (p[0] - p[1]) ^ (p[2] - p[1]);
+	const float subpixels = float(1 << SUBPIXEL_BITS);
+	const long long one = 1 << SUBPIXEL_BITS, half = one / 2;
+	long long x[3], y[3];
 
-	if (a <= 0) // front face
+	for (int k = 0; k < 3; k++)
 	{
-		return; // back face cull
+		if (!(fabs(p[k].x) < MAX_COORD && fabs(p[k].y) < MAX_COORD)) // (or NaN)
+			return false;
+		x[k] = lrintf(p[k].x * subpixels);
+		y[k] = lrintf(p[k].y * subpixels);
 	}
 
-	float i2a = (a == 0) ? 0.0f : -1.0f / a;		
+	// pixels whose centers are in the bounding box (with multisampling, any pixel overlapping it)
 
-	//Vec2 n0 = (p[2] - p[1]).perpend() * i2a;
-	Vec2 n1 = (p[0] - p[2]).perpend() * i2a;
-	Vec2 n2 = (p[1] - p[0]).perpend() * i2a;
+	long long margin = _samples > 1 ? half : 0;
+	int jmin = int((min(min(x[0], x[1]), x[2]) - half - margin + one - 1) >> SUBPIXEL_BITS);
+	int jmax = int((max(max(x[0], x[1]), x[2]) - half + margin) >> SUBPIXEL_BITS);
+	int imin = int((min(min(y[0], y[1]), y[2]) - half - margin + one - 1) >> SUBPIXEL_BITS);
+	int imax = int((max(max(y[0], y[1]), y[2]) - half + margin) >> SUBPIXEL_BITS);
+	jmin = max(jmin, 0);
+	jmax = min(jmax, _depth.cols() - 1);
+	imin = max(imin, 0);
+	imax = min(imax, _depth.rows() - 1);
 
-	pmin.x = clamp(pmin.x, 0.f, w - 1);
-	pmax.x = clamp(pmax.x, 0.f, w - 1);
-	pmin.y = clamp(pmin.y, 0.f, h - 1);
-	pmax.y = clamp(pmax.y, 0.f, h - 1);
+	if (jmin > jmax || imin > imax) // no pixels covered
+		return false;
 
-	float zz[4] = { ndc[0].z, ndc[1].z, ndc[2].z, 1 };
-	float iz[4] = { -1 / vertices[0].z, -1 / vertices[1].z, -1 / vertices[2].z, 1 };
+	if ((x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]) >= 0) // back face or degenerate
+		return false;
 
-	bool persp = _projection(3, 3) == 0;
-	bool hasspecular = _material->shininess != 0;
-	bool hastexture = _texturing && _material->texture.rows() > 0;
+	// edge function of vertex k: zero on the opposite edge (from vertex k + 1 to k + 2), positive inside
+
+	for (int k = 0; k < 3; k++)
+	{
+		int u = (k + 1) % 3, v = (k + 2) % 3;
+		long long a = y[v] - y[u], b = x[u] - x[v];
+		bool topLeft = a > 0 || (a == 0 && b > 0); // left edge, or top edge (y grows downwards)
+		long long c = a * (half - x[u]) + b * (half - y[u]) - (topLeft ? 0 : 1);
+		t.ea[k] = int(a);
+		t.eb[k] = int(b);
+		t.ec[k] = c;
+		p[k] = Vec2(float(x[k]), float(y[k])) / subpixels;
+	}
+
+	float a = (p[0] - p[1]) ^ (p[2] - p[1]);
+	float i2a = -1.0f / a;
+
+	t.n1 = (p[0] - p[2]).perpend() * i2a;
+	t.n2 = (p[1] - p[0]).perpend() * i2a;
+
+	t.pmin = Vec2(float(jmin), float(imin));
+	t.pmax = Vec2(float(jmax), float(imax));
 
-	Vec3 color = _material->diffuse;
-	Vec3 emissive = _material->emissive;
-	auto mspecular = _material->specular;
-	auto shininess = _material->shininess;
-	const auto& texture = _material->texture;
+	t.state = _state;
+	t.mesh = _meshCount;
+	return true;
+}
+
+// paints the part of triangle t within image rows [row0, row1]. The bounding box is traversed in blocks of
+// BLOCK_SIZE x BLOCK_SIZE pixels classified by their corners: blocks outside an edge are skipped, blocks inside all
+// edges are painted without per-pixel edge tests. Pixels are processed SIMD_WIDTH at a time. In deferred mode the
+// visible pixels only record the triangle id and barycentrics, and in depth-only passes only the depth is written.
+// With multisampling, coverage and depth are tested at each sample, and pixels are shaded once at their center.
+// Returns if any pixel passed the depth test
+
+bool Renderer::rasterize(const Triangle& t, int id, int row0, int row1, RenderStats& stats)
+{
+	if (_samples > 1)
+		return _persp ? rasterizeKernel<true, true>(t, id, row0, row1, stats) : rasterizeKernel<false, true>(t, id, row0, row1, stats);
+	return _persp ? rasterizeKernel<true, false>(t, id, row0, row1, stats) : rasterizeKernel<false, false>(t, id, row0, row1, stats);
+}
 
-	float k[4] = { 0, 0, 0, 0 };
+template<bool Persp, bool Multisample>
+bool Renderer::rasterizeKernel(const Triangle& t, int id, int row0, int row1, RenderStats& stats)
+{
+	typedef simd::Floats Floats;
+	typedef simd::Ints Ints;
 
-	for (float y = floor(pmin.y) + 0.5f; y <= pmax.y + 0.5f; y++)
+	const Vec2* p = t.p;
+	const Vec2& n1 = t.n1;
+	const Vec2& n2 = t.n2;
+	const float* zz = t.zz;
+	const float* iz = t.iz;
+
+	ShadeKernel shader = shadeKernels[_states[t.state].kernel];
+
+	// integer edge functions at pixel centers, and their offsets at each sample (exact, as the values in sub-pixels
+	// are rounded down to whole pixel steps) and the range of those offsets
+
+	const int nsamples = Multisample ? _samples : 1;
+	const int* offsets = sampleOffsets(nsamples);
+	long long ec[3];
+	int sd[3][MAX_SAMPLES], dmin[3], dmax[3];
+
+	for (int k = 0; k < 3; k++)
 	{
-		Vec2 pt(floor(pmin.x) + 0.5f, y);
-		float e1 = n1 * (pt - p[2]);
-		float e2 = n2 * (pt - p[0]);
-		for (float x = pt.x; x <= pmax.x + 0.5f; x++, e1 += n1.x, e2 += n2.x)
+		ec[k] = t.ec[k] >> SUBPIXEL_BITS;
+		dmin[k] = dmax[k] = 0;
+		for (int s = 0; Multisample && s < nsamples; s++)
 		{
-			if (e1 < 0 || e2 < 0 || 1 - e1 - e2 < 0)
-				continue;
-			k[0] = 1.f - e1 - e2;
-			k[1] = e1;
-			k[2] = e2;
+			long long c = t.ec[k] + t.ea[k] * (long long)offsets[2 * s] + t.eb[k] * (long long)offsets[2 * s + 1];
+			sd[k][s] = int((c >> SUBPIXEL_BITS) - ec[k]);
+			dmin[k] = min(dmin[k], sd[k][s]);
+			dmax[k] = max(dmax[k], sd[k][s]);
+		}
+	}
+
+	const Floats ramp = Floats::ramp();
+	const int jmin = int(floor(t.pmin.x)), jmax = int(t.pmax.x);
+	const int imin = int(floor(t.pmin.y)), imax = int(t.pmax.y);
+	float kk[3][SIMD_WIDTH], zs[SIMD_WIDTH];
+	int smask[MAX_SAMPLES];
+	bool visible = false;
+
+	// edge functions at the first column of row i (each pixel is then offset from it)
+
+	auto edges = [&](int i, float& e1, float& e2) {
+		Vec2 pt(jmin + 0.5f, i + 0.5f);
+		e1 = n1 * (pt - p[2]);
+		e2 = n2 * (pt - p[0]);
+	};
+
+	// depth test and shading of the n pixels of row i from column j given by mask
+
+	auto paint = [&](int i, int j, int n, int mask, Floats k0, Floats k1, Floats k2) {
+		float* depth = &_depth(i, 0);
+		Floats z;
+
+		if (Persp)
+		{
+			z = Floats(1.f) / (k0 * iz[0] + k1 * iz[1] + k2 * iz[2]);
+			k0 = k0 * (Floats(iz[0]) * z);
+			k1 = k1 * (Floats(iz[1]) * z);
+			k2 = k2 * (Floats(iz[2]) * z);
+		}
+		else
+			z = k0 * zz[0] + k1 * zz[1] + k2 * zz[2];
+
+		Floats d = n == SIMD_WIDTH ? Floats::load(depth + j) : simd::loadPartial(depth + j, n);
+		mask &= (_zEqual ? d >= z : z < d).mask();
+		if (_zEqual) // only the triangle that won the depth test (the first at equal depth, as without a prepass)
+		{
+			const int* ids = &_ids(i, j);
+			for (int l = 0; l < n; l++)
+				if (ids[l] != id)
+					mask &= ~(1 << l);
+		}
+		if (!mask)
+			return;
 
-			float z;
+		visible = true;
+		k0.store(kk[0]);
+		k1.store(kk[1]);
+		k2.store(kk[2]);
 
-			if (persp)
+		if (_zEqual) // depth already resolved by the prepass
+		{
+			(this->*shader)(t, i, j, n, mask, kk[0], kk[1], kk[2]);
+			return;
+		}
+
+		z.store(zs);
+		bool deferred = _deferred && _shading;
+
+		for (int l = 0; l < n; l++)
+		{
+			if (mask & (1 << l))
 			{
-				z = 1.f / (k[0] * iz[0] + k[1] * iz[1] + k[2] * iz[2]);
-				k[0] *= iz[0] * z;
-				k[1] *= iz[1] * z;
-				k[2] *= iz[2] * z;
+				depth[j + l] = zs[l];
+				if (deferred)
+				{
+					_ids(i, j + l) = id;
+					_bary(i, j + l) = Vec3(kk[0][l], kk[1][l], kk[2][l]);
+				}
+				else if (_prepass)
+					_ids(i, j + l) = id;
 			}
-			else
-				z = k[0] * zz[0] + k[1] * zz[1] + k[2] * zz[2] + k[3] * zz[3];
+		}
 
-			int i = int(y), j = int(x);
+		if (_shading && !deferred)
+			(this->*shader)(t, i, j, n, mask, kk[0], kk[1], kk[2]);
+	};
 
-			auto& pixdepth = _depth(i, j);
+	// multisampling: depth test of the samples of the n pixels of row i from column j given by smask, and shading of
+	// the pixels with samples passing it (written to the image and then copied to those samples)
 
-			if (z < pixdepth)
-			{
-				pixdepth = z;
+	auto paintSamples = [&](int i, int j, int n, Floats k0, Floats k1, Floats k2) {
+		int passed[MAX_SAMPLES];
+		int mask = 0;
 
-				if (hastexture)
+		for (int s = 0; s < nsamples; s++)
+		{
+			passed[s] = 0;
+			if (!smask[s])
+				continue;
+			float ox = offsets[2 * s] / float(1 << SUBPIXEL_BITS), oy = offsets[2 * s + 1] / float(1 << SUBPIXEL_BITS);
+			Floats s1 = k1 + (n1.x * ox + n1.y * oy);
+			Floats s2 = k2 + (n2.x * ox + n2.y * oy);
+			Floats s0 = Floats(1.f) - s1 - s2;
+			Floats z = Persp ? Floats(1.f) / (s0 * iz[0] + s1 * iz[1] + s2 * iz[2]) : s0 * zz[0] + s1 * zz[1] + s2 * zz[2];
+			float* depth = &_sdepth(i * nsamples + s, j);
+			Floats d = n == SIMD_WIDTH ? Floats::load(depth) : simd::loadPartial(depth, n);
+			passed[s] = smask[s] & (_zEqual ? d >= z : z < d).mask();
+			int* ids = _zEqual || _prepass ? &_sids(i * nsamples + s, j) : 0;
+			if (_zEqual)
+			{
+				for (int l = 0; l < n; l++)
+					if (ids[l] != id)
+						passed[s] &= ~(1 << l);
+			}
+			mask |= passed[s];
+			if (passed[s] && !_zEqual)
+			{
+				z.store(zs);
+				for (int l = 0; l < n; l++)
 				{
-					Vec2 uv = k[0] * texcoords[0] + k[1] * texcoords[1] + k[2] * texcoords[2];
-					color = texture(int(fract(uv.y) * texture.rows()), int(fract(uv.x) * texture.cols()));
+					if (passed[s] & (1 << l))
+					{
+						depth[l] = zs[l];
+						if (_prepass)
+							ids[l] = id;
+					}
 				}
+			}
+		}
+
+		if (!mask)
+			return;
 
-				Vec3 value = emissive;
+		visible = true;
+
+		if (!_shading)
+			return;
+
+		if (Persp)
+		{
+			Floats z = Floats(1.f) / (k0 * iz[0] + k1 * iz[1] + k2 * iz[2]);
+			k0 = k0 * (Floats(iz[0]) * z);
+			k1 = k1 * (Floats(iz[1]) * z);
+			k2 = k2 * (Floats(iz[2]) * z);
+		}
+		k0.store(kk[0]);
+		k1.store(kk[1]);
+		k2.store(kk[2]);
+		(this->*shader)(t, i, j, n, mask, kk[0], kk[1], kk[2]);
 
-				if (_lighting)
+		for (int s = 0; s < nsamples; s++)
+			for (int l = 0; l < n; l++)
+				if (passed[s] & (1 << l))
+					_scolor(i * nsamples + s, j + l) = _image(i, j + l);
+	};
+
+	float e1r[BLOCK_SIZE], e2r[BLOCK_SIZE];
+
+	for (int bi = max(imin, row0) / BLOCK_SIZE * BLOCK_SIZE; bi <= min(imax, row1); bi += BLOCK_SIZE)
+	{
+		int i0 = max(bi, imin), i1 = min(bi + BLOCK_SIZE - 1, imax); // block rows, for classification
+		int r0 = max(i0, row0), r1 = min(i1, row1);                  // block rows to paint
+
+		for (int i = r0; i <= r1; i++)
+			edges(i, e1r[i - bi], e2r[i - bi]);
+
+		for (int bj = jmin / BLOCK_SIZE * BLOCK_SIZE; bj <= jmax; bj += BLOCK_SIZE)
+		{
+			int j0 = max(bj, jmin), j1 = min(bj + BLOCK_SIZE - 1, jmax);
+
+			// integer edge functions at the block corners: edges crossing the block (at any sample) are tested per
+			// pixel, starting from the value at (r0, j0), which is small (within the range of the corners); the others
+			// get a large positive value that sample offsets cannot make negative
+
+			bool outside = false, inside = true;
+			Ints er[3], ej[3], ei[3]; // at the row start, and steps for the next SIMD_WIDTH pixels and next row
+
+			for (int k = 0; k < 3; k++)
+			{
+				long long c00 = t.ea[k] * (long long)j0 + t.eb[k] * (long long)i0 + ec[k];
+				long long c01 = c00 + t.ea[k] * (long long)(j1 - j0);
+				long long c10 = c00 + t.eb[k] * (long long)(i1 - i0);
+				long long c11 = c01 + c10 - c00;
+				long long cmin = min(min(c00, c01), min(c10, c11)), cmax = max(max(c00, c01), max(c10, c11));
+				outside = outside || cmax + dmax[k] < 0;
+				inside = inside && cmin + dmin[k] >= 0;
+				bool crossing = cmin + dmin[k] < 0;
+				er[k] = crossing ? Ints::ramp(int(c00 + t.eb[k] * (long long)(r0 - i0)), t.ea[k]) : 1 << 30;
+				ej[k] = crossing ? t.ea[k] * SIMD_WIDTH : 0;
+				ei[k] = crossing ? t.eb[k] : 0;
+			}
+
+			if (outside)
+				continue;
+
+			for (int i = r0; i <= r1; i++)
+			{
+				Floats e1 = e1r[i - bi], e2 = e2r[i - bi];
+				Ints c0 = er[0], c1 = er[1], c2 = er[2];
+				for (int j = j0; j <= j1; j += SIMD_WIDTH)
 				{
-					Vec3 position = k[0] * vertices[0] + k[1] * vertices[1] + k[2] * vertices[2];
-					Vec3 lightdir = _lightIsPoint ? (_lightdir - position).normalized() : _lightdir;
-					
-#ifndef FAST_LIGHT
-					Vec3 normal = (k[0] * normals[0] + k[1] * normals[1] + k[2] * normals[2]).normalized();
-					value += (max(0.0f, normal * lightdir) + _ambient) * color;
-#else
-					Vec3 normal = (k[0] * normals[0] + k[1] * normals[1] + k[2] * normals[2]);
-					value += (max(0.0f, normal * lightdir)/normal.length() + _ambient) * color;
-#endif
-
-					if (hasspecular)
+					int n = min(SIMD_WIDTH, j1 - j + 1);
+					Floats x = ramp + float(j - jmin);
+					Floats k1 = e1 + x * n1.x;
+					Floats k2 = e2 + x * n2.x;
+					Floats k0 = Floats(1.f) - k1 - k2;
+					int full = (1 << n) - 1, mask = full;
+					if (Multisample)
 					{
-						Vec3 viewDir = position.normalized();
-#ifndef FAST_LIGHT
-						float specular = pow(max((lightdir - viewDir).normalized() * normal, 0.0f), _material->shininess);
-#else
-						float specular = pow(max((lightdir - viewDir) * normal, 0.0f) / ((lightdir - viewDir).length() * normal.length()), shininess);
-#endif
-						value += specular * mspecular;
+						mask = 0;
+						for (int s = 0; s < nsamples; s++)
+						{
+							smask[s] = inside ? full : full & ~((c0 + sd[0][s]) | (c1 + sd[1][s]) | (c2 + sd[2][s])).negative();
+							mask |= smask[s];
+						}
 					}
-					if (_saveNormals)
-						_pnormals(i, j) = normal;
+					else if (!inside)
+						mask &= ~(c0 | c1 | c2).negative();
+					if (!inside)
+					{
+						c0 = c0 + ej[0];
+						c1 = c1 + ej[1];
+						c2 = c2 + ej[2];
+						stats.pixelsTested += n;
+					}
+					stats.pixelsCovered += simd::countLanes(mask);
+					if (mask && Multisample)
+						paintSamples(i, j, n, k0, k1, k2);
+					else if (mask)
+						paint(i, j, n, mask, k0, k1, k2);
 				}
-				_image(i, j) = value;
+				er[0] = er[0] + ei[0];
+				er[1] = er[1] + ei[1];
+				er[2] = er[2] + ei[2];
 			}
 		}
 	}
+	return visible;
+}
+
+// shading kernels specialized for each combination of flags (see shadingKernel)
+
+#define SHADE_KERNEL(f) &Renderer::shadeKernel<((f) & 1) != 0, ((f) & 2) != 0, ((f) & 4) != 0, ((f) & 8) != 0, ((f) & 16) != 0>
+#define SHADE_KERNELS4(f) SHADE_KERNEL(f), SHADE_KERNEL(f + 1), SHADE_KERNEL(f + 2), SHADE_KERNEL(f + 3)
+
+const Renderer::ShadeKernel Renderer::shadeKernels[32] = {
+	SHADE_KERNELS4(0), SHADE_KERNELS4(4), SHADE_KERNELS4(8), SHADE_KERNELS4(12),
+	SHADE_KERNELS4(16), SHADE_KERNELS4(20), SHADE_KERNELS4(24), SHADE_KERNELS4(28)
+};
+
+// index of the shading kernel for the current flags and a material
+
+int Renderer::shadingKernel(const Material& material) const
+{
+	bool texture = _texturing && material.texture.rows() > 0 && material.texture.cols() > 0;
+	bool specular = _lighting && material.shininess != 0;
+	bool point = _lighting && _lightIsPoint;
+	bool normals = _lighting && _saveNormals;
+	return (texture ? 1 : 0) | (_lighting ? 2 : 0) | (point ? 4 : 0) | (specular ? 8 : 0) | (normals ? 16 : 0);
+}
+
+void Renderer::shade(const Triangle& t, int i, int j, int n, int mask, const float* k0, const float* k1, const float* k2)
+{
+	(this->*shadeKernels[_states[t.state].kernel])(t, i, j, n, mask, k0, k1, k2);
+}
+
+// shades the n pixels of row i from column j given by mask, with perspective-correct barycentrics k0, k1, k2
+
+template<bool Texture, bool Lighting, bool PointLight, bool Specular, bool Normals>
+void Renderer::shadeKernel(const Triangle& t, int i, int j, int n, int mask, const float* k0_, const float* k1_, const float* k2_)
+{
+	typedef simd::Floats Floats;
+
+	const Vec3* vertices = t.vertices;
+	const Vec3* normals = t.normals;
+	const Vec2* texcoords = t.texcoords;
+	const ShadingState& state = _states[t.state];
+
+	Vec3 color = state.diffuse;
+	Vec3 emissive = state.emissive;
+	auto mspecular = state.specular;
+	auto shininess = state.shininess;
+
+	Floats k0 = Floats::load(k0_), k1 = Floats::load(k1_), k2 = Floats::load(k2_);
+	float rgb[3][SIMD_WIDTH], nor[3][SIMD_WIDTH];
+
+	Floats cr = color.x, cg = color.y, cb = color.z;
+
+	if (Texture)
+	{
+		// mipmap level from the derivatives of uv along columns and rows at the first pixel (the others are adjacent),
+		// from those of the screen-linear barycentrics (g) through the perspective division: uv = sum(b' iz uv) / w,
+		// with w = sum(b' iz) = 1 / sum(k / iz), where 1 / iz is the view depth -z
+
+		const minirender::Texture& texture = *state.texture;
+		const Vec2 g[3] = { -(t.n1 + t.n2), t.n1, t.n2 };
+		const float tiz[3] = { _persp ? t.iz[0] : 1.f, _persp ? t.iz[1] : 1.f, _persp ? t.iz[2] : 1.f };
+		Vec2 ux(0, 0), uy(0, 0);
+		float wx = 0, wy = 0;
+		for (int k = 0; k < 3; k++)
+		{
+			ux += texcoords[k] * (tiz[k] * g[k].x);
+			uy += texcoords[k] * (tiz[k] * g[k].y);
+			wx += tiz[k] * g[k].x;
+			wy += tiz[k] * g[k].y;
+		}
+		int first = 0;
+		while (first < SIMD_WIDTH - 1 && !(mask & (1 << first)))
+			first++;
+		Vec2 uv0 = k0_[first] * texcoords[0] + k1_[first] * texcoords[1] + k2_[first] * texcoords[2];
+		float iw = _persp ? -(k0_[first] * vertices[0].z + k1_[first] * vertices[1].z + k2_[first] * vertices[2].z) : 1.f;
+		float lod = texture.lod((ux - uv0 * wx) * iw, (uy - uv0 * wy) * iw);
+
+		float u[SIMD_WIDTH], v[SIMD_WIDTH];
+		(k0 * texcoords[0].x + k1 * texcoords[1].x + k2 * texcoords[2].x).store(u);
+		(k0 * texcoords[0].y + k1 * texcoords[1].y + k2 * texcoords[2].y).store(v);
+		texture.sample(n, mask, u, v, lod, _textureFilter, rgb[0], rgb[1], rgb[2]);
+		cr = Floats::load(rgb[0]);
+		cg = Floats::load(rgb[1]);
+		cb = Floats::load(rgb[2]);
+	}
+
+	Floats r = emissive.x, g = emissive.y, b = emissive.z;
+
+	if (Lighting)
+	{
+		Floats px = k0 * vertices[0].x + k1 * vertices[1].x + k2 * vertices[2].x;
+		Floats py = k0 * vertices[0].y + k1 * vertices[1].y + k2 * vertices[2].y;
+		Floats pz = k0 * vertices[0].z + k1 * vertices[1].z + k2 * vertices[2].z;
+		Floats lx = _lightdir.x, ly = _lightdir.y, lz = _lightdir.z;
+		if (PointLight)
+		{
+			lx = lx - px;
+			ly = ly - py;
+			lz = lz - pz;
+			Floats il = Floats(1.f) / sqrt(lx * lx + ly * ly + lz * lz);
+			lx = lx * il;
+			ly = ly * il;
+			lz = lz * il;
+		}
+		Floats nx = k0 * normals[0].x + k1 * normals[1].x + k2 * normals[2].x;
+		Floats ny = k0 * normals[0].y + k1 * normals[1].y + k2 * normals[2].y;
+		Floats nz = k0 * normals[0].z + k1 * normals[1].z + k2 * normals[2].z;
+		Floats nl = sqrt(nx * nx + ny * ny + nz * nz);
+		Floats diffuse = max(nx * lx + ny * ly + nz * lz, 0.f) / nl + _ambient;
+		r = r + diffuse * cr;
+		g = g + diffuse * cg;
+		b = b + diffuse * cb;
+
+		if (Specular)
+		{
+			Floats iv = Floats(1.f) / sqrt(px * px + py * py + pz * pz);
+			Floats hx = lx - px * iv, hy = ly - py * iv, hz = lz - pz * iv;
+			Floats hn = max(hx * nx + hy * ny + hz * nz, 0.f) / (sqrt(hx * hx + hy * hy + hz * hz) * nl);
+			Floats specular = pow(hn, shininess);
+			r = r + specular * mspecular.x;
+			g = g + specular * mspecular.y;
+			b = b + specular * mspecular.z;
+		}
+		if (Normals)
+		{
+			nx.store(nor[0]);
+			ny.store(nor[1]);
+			nz.store(nor[2]);
+			for (int l = 0; l < n; l++)
+				if (mask & (1 << l))
+					_pnormals(i, j + l) = Vec3(nor[0][l], nor[1][l], nor[2][l]);
+		}
+	}
+
+	r.store(rgb[0]);
+	g.store(rgb[1]);
+	b.store(rgb[2]);
+	if (_compact && _samples == 1)
+	{
+		for (int l = 0; l < n; l++)
+			if (mask & (1 << l))
+				_rgba(i, j + l) = packRGBA(rgb[0][l], rgb[1][l], rgb[2][l]);
+	}
+	else
+	{
+		for (int l = 0; l < n; l++)
+			if (mask & (1 << l))
+				_image(i, j + l) = Vec3(rgb[0][l], rgb[1][l], rgb[2][l]);
+	}
+}
+
+// shades every visible pixel once from the triangle ids and barycentrics of the deferred pass, in runs of up to
+// SIMD_WIDTH pixels of the same triangle
+
+void Renderer::shadeDeferred()
+{
+	int ntiles = (_depth.rows() + TILE_ROWS - 1) / TILE_ROWS;
+
+	parallelFor(ntiles, _threads, [this](int b) {
+		float k[3][SIMD_WIDTH];
+		int row1 = min((b + 1) * TILE_ROWS, _depth.rows());
+		for (int i = b * TILE_ROWS; i < row1; i++)
+		{
+			for (int j = 0; j < _depth.cols();)
+			{
+				int id = _ids(i, j);
+				if (id < 0)
+				{
+					j++;
+					continue;
+				}
+				int n = 0;
+				for (; n < SIMD_WIDTH && j + n < _depth.cols() && _ids(i, j + n) == id; n++)
+				{
+					const Vec3& bary = _bary(i, j + n);
+					k[0][n] = bary.x;
+					k[1][n] = bary.y;
+					k[2][n] = bary.z;
+				}
+				for (int l = n; l < SIMD_WIDTH; l++)
+					k[0][l] = k[1][l] = k[2][l] = 0;
+				shade(_triangles[id], i, j, n, (1 << n) - 1, k[0], k[1], k[2]);
+				j += n;
+			}
+		}
+	});
+}
+
+// multisampling: the depth of each pixel becomes that of its nearest sample, and its color the average of its samples
+
+void Renderer::resolve()
+{
+	int ntiles = (_depth.rows() + TILE_ROWS - 1) / TILE_ROWS;
+	bool shading = !_depthOnly;
+
+	parallelFor(ntiles, _threads, [=](int b) {
+		int row1 = min((b + 1) * TILE_ROWS, _depth.rows());
+		float k = 1.0f / _samples;
+		for (int i = b * TILE_ROWS; i < row1; i++)
+		{
+			for (int j = 0; j < _depth.cols(); j++)
+			{
+				float z = _sdepth(i * _samples, j);
+				Vec3 color = _scolor(i * _samples, j);
+				for (int s = 1; s < _samples; s++)
+				{
+					z = min(z, _sdepth(i * _samples + s, j));
+					color += _scolor(i * _samples + s, j);
+				}
+				_depth(i, j) = z;
+				if (!shading)
+					continue;
+				color *= k;
+				if (_compact)
+					_rgba(i, j) = packRGBA(color.x, color.y, color.z);
+				else
+					_image(i, j) = color;
+			}
+		}
+	});
+}
+
+// paints the batched triangles: they are binned to tiles of TILE_ROWS image rows and each tile is painted
+// by one thread, keeping the triangle order within it
+
+void Renderer::flush()
+{
+	int ntiles = (_depth.rows() + TILE_ROWS - 1) / TILE_ROWS;
+	_binStart.resize(ntiles + 1);
+	for (int b = 0; b <= ntiles; b++)
+		_binStart[b] = 0;
+
+	for (int i = _firstBinned; i < _triangles.length(); i++)
+	{
+		const Triangle& t = _triangles[i];
+		for (int b = int(t.pmin.y) / TILE_ROWS; b <= int(t.pmax.y) / TILE_ROWS; b++)
+			_binStart[b]++;
+	}
+
+	for (int b = 0, n = 0; b <= ntiles; b++)
+		_binStart[b] = (n += _binStart[b]);
+
+	_binItems.resize(_binStart[ntiles]);
+
+	for (int i = _triangles.length() - 1; i >= _firstBinned; i--)
+	{
+		const Triangle& t = _triangles[i];
+		for (int b = int(t.pmin.y) / TILE_ROWS; b <= int(t.pmax.y) / TILE_ROWS; b++)
+			_binItems[--_binStart[b]] = i;
+	}
+
+	_tileStats.resize(ntiles);
+
+	parallelFor(ntiles, _threads, [this](int b) {
+		int row0 = b * TILE_ROWS;
+		int row1 = min(row0 + TILE_ROWS, _depth.rows()) - 1;
+		RenderStats stats;
+		for (int k = _binStart[b]; k < _binStart[b + 1]; k++)
+			rasterize(_triangles[_binItems[k]], _triangleBase + _binItems[k], row0, row1, stats);
+		_tileStats[b] = stats;
+	});
+
+	for (auto& stats : _tileStats)
+		_stats += stats;
+
+	if (_deferred && _shading) // keep the triangles for the shading pass
+		_firstBinned = _triangles.length();
+	else
+	{
+		_triangleBase += _triangles.length();
+		_triangles.clear();
+	}
 }
 
 void Renderer::render()
+{
+	_scene->updateBvh();
+	draw();
+}
+
+// renders the scene from the current view (the scene BVH must be up to date)
+
+void Renderer::draw()
 {
 	clear();
-	_renderables.clear();
-	_scene->collectShapes(_renderables, Matrix4::identity());
+	_stats = RenderStats();
+	_triangles.clear();
+	_firstBinned = 0;
+	_triangleBase = 0;
+	_meshCount = 0;
+	cull();
 
 	if (_lightIsPoint)
 		_lightdir = _view * _light;
@@ -325,81 +1079,369 @@ void Renderer::render()
 	_znear = persp ? _projection(2, 3) / (_projection(2, 2) - 1) : (_projection(2, 3) + 1) / _projection(2, 2);
 	_znear = -_znear;
 
+	_shading = !_depthOnly;
+	_zEqual = false;
+
+	if (_depthPrepass && _shading && !_deferred)
+	{
+		_shading = false;
+		_prepass = true;
+		for (auto& item : _renderables)
+			paintMesh(item.mesh, item.transform);
+		_shading = true;
+		_prepass = false;
+		_zEqual = true;
+		_triangleBase = 0; // the shading pass sets up the same triangles again, with the same ids
+	}
+
 	for (auto& item : _renderables)
 	{
 		paintMesh(item.mesh, item.transform);
 	}
+
+	_zEqual = false;
+
+	if (_deferred && _shading)
+	{
+		shadeDeferred();
+		_triangles.clear();
+	}
+
+	if (_samples > 1)
+		resolve();
+}
+
+void Renderer::renderViews(const Array<Matrix4>& views, Array<Array2<Vec3>>& images, Array<Array2<float>>& depths)
+{
+	int w = _depth.cols(), h = _depth.rows();
+	images.resize(views.length());
+	for (auto& image : images)
+		if (image.rows() != h || image.cols() != w)
+			image.resize(h, w);
+	depths.resize(views.length());
+	for (auto& depth : depths)
+		if (depth.rows() != h || depth.cols() != w)
+			depth.resize(h, w);
+	renderViews(views, [&](Renderer& r, int i) {
+		r._image = images[i];
+		r._depth = depths[i];
+		r._compact = false;
+	});
+}
+
+void Renderer::renderViews(const Array<Matrix4>& views, Array<Array2<unsigned>>& images, Array<Array2<float>>& depths)
+{
+	int w = _depth.cols(), h = _depth.rows();
+	images.resize(views.length());
+	for (auto& image : images)
+		if (image.rows() != h || image.cols() != w)
+			image.resize(h, w);
+	depths.resize(views.length());
+	for (auto& depth : depths)
+		if (depth.rows() != h || depth.cols() != w)
+			depth.resize(h, w);
+	renderViews(views, [&](Renderer& r, int i) {
+		r._rgba = images[i];
+		r._depth = depths[i];
+		r._compact = true;
+	});
+}
+
+// renders each view with a helper renderer per thread, which takes the settings of this one and paints into the
+// buffers given by bind. The scene and its meshes are only read while painting. The helpers are kept with their
+// buffers for the next call, and helper k always paints views k, k + nworkers..., so that repeating the same views
+// finds the buffers already sized for them
+
+void Renderer::renderViews(const Array<Matrix4>& views, const std::function<void(Renderer&, int)>& bind)
+{
+	_scene->updateBvh();
+	int w = _depth.cols(), h = _depth.rows();
+
+	// the meshes and materials are shared by the views, so their cached boxes and textures are filled here, for the
+	// views to only read them
+	for (auto& item : _scene->getBvh().items)
+	{
+		item.mesh->getLocalBbox();
+		if (_texturing && item.mesh->material)
+			item.mesh->material->getTexture();
+	}
+
+	int nworkers = min(_threads, views.length());
+	while (_viewRenderers.length() < nworkers)
+		_viewRenderers << Shared<Renderer>(new Renderer());
+	_viewStats.resize(nworkers);
+
+	for (int k = 0; k < nworkers; k++)
+	{
+		Renderer& r = *_viewRenderers[k];
+		r._scene = _scene;
+		r.setProjection(_projection);
+		r._light = _light;
+		r._lightIsPoint = _lightIsPoint;
+		r._bgcolor = _bgcolor;
+		r._lighting = _lighting;
+		r._texturing = _texturing;
+		r._saveNormals = _saveNormals;
+		r._deferred = _deferred;
+		r._depthPrepass = _depthPrepass;
+		r._depthOnly = _depthOnly;
+		r._sortMeshes = _sortMeshes;
+		r._samples = _samples;
+		r._textureFilter = _textureFilter;
+		r._threads = 1;
+		_viewStats[k] = RenderStats();
+	}
+
+	auto paintViews = [&](int k) {
+		Renderer& r = *_viewRenderers[k];
+		Array2<Vec3>     image = r._image;
+		Array2<unsigned> rgba = r._rgba;
+		Array2<float>    depth = r._depth;
+		for (int i = k; i < views.length(); i += nworkers)
+		{
+			bind(r, i);
+			r.resizeBuffers(w, h);
+			r._view = views[i];
+			r.draw();
+			_viewStats[k] += r._stats;
+		}
+		// back to its own buffers, not to keep (and later resize) the caller ones
+		r._image = image;
+		r._rgba = rgba;
+		r._depth = depth;
+	};
+	parallelFor(nworkers, nworkers, std::ref(paintViews)); // (a reference, not copied to the heap by std::function)
+
+	_stats = RenderStats();
+	for (auto& s : _viewStats)
+		_stats += s;
+}
+
+// finds the renderables that may be visible by culling the scene BVH with the view frustum, keeping scene order
+
+void Renderer::cull()
+{
+	const Bvh& bvh = _scene->getBvh();
+	_visible.clear();
+	bvh.cull(_projection * _view, _visible);
+	_visible.sort();
+	_renderables.resize(_visible.length());
+	for (int i = 0; i < _visible.length(); i++)
+		_renderables[i] = bvh.items[_visible[i]];
+	_stats.meshesDrawn = _renderables.length();
+	_stats.meshesCulled = bvh.items.length() - _renderables.length();
+
+	// by material, in the order they first appear in the scene (not by address, so the order is the same every run),
+	// then front to back (by the view depth of their box centers), and then in scene order
+	if (_sortMeshes)
+	{
+		const Material* defmaterial = _defmaterial.ptr();
+		_sortKeys.resize(_renderables.length());
+		for (int i = 0; i < _renderables.length(); i++)
+		{
+			const Renderable& item = _renderables[i];
+			MeshSortKey& key = _sortKeys[i];
+			key.material = item.mesh->material ? item.mesh->material.ptr() : defmaterial;
+			key.depth = (_view * item.transform * item.mesh->getLocalBbox().center()).z;
+			key.index = i;
+		}
+		// grouped by material (in any order) to find the first mesh of each
+		_sortKeys.sort([](const MeshSortKey& a, const MeshSortKey& b) {
+			return a.material != b.material ? a.material < b.material : a.index < b.index;
+		});
+		for (int i = 0; i < _sortKeys.length(); i++)
+			_sortKeys[i].first = (i > 0 && _sortKeys[i].material == _sortKeys[i - 1].material) ? _sortKeys[i - 1].first
+			                                                                                  : _sortKeys[i].index;
+		_sortKeys.sort([](const MeshSortKey& a, const MeshSortKey& b) {
+			if (a.first != b.first)
+				return a.first < b.first;
+			if (a.depth != b.depth)
+				return a.depth > b.depth;
+			return a.index < b.index;
+		});
+		for (int i = 0; i < _sortKeys.length(); i++)
+			_renderables[i] = bvh.items[_visible[_sortKeys[i].index]];
+	}
+}
+
+// makes the current material and flags the shading state of the next triangles (a new state only if they changed)
+
+void Renderer::useMaterial()
+{
+	const Material& material = *_material;
+	int kernel = shadingKernel(material);
+	if (_states.length() > 0 && _states.last().material == &material && _states.last().kernel == kernel)
+		return;
+	ShadingState state;
+	state.material = &material;
+	state.kernel = kernel;
+	state.diffuse = material.diffuse;
+	state.specular = material.specular;
+	state.emissive = material.emissive;
+	state.shininess = material.shininess;
+	state.texture = (kernel & 1) ? &material.getTexture() : 0;
+	_states << state;
+	_state = _states.length() - 1;
 }
 
 void Renderer::paintMesh(TriMesh* mesh, const Matrix4& transform)
 {
 	_material = (mesh->material) ? mesh->material : _defmaterial;
+	useMaterial();
 	_modelview = _view * transform;
 	_normalmat = _modelview.inverse().t();
+	_binning = _threads > 1;
+
+	// vertex stage: each vertex is transformed and projected once, triangles read them by index. Normals are only
+	// needed for lighting
 
-#ifdef PREMULT
 	_vertices.resize(mesh->vertices.length());
-	_normals.resize(mesh->normals.length());
+	_projected.resize(mesh->vertices.length());
+	_normals.resize(_shading && _lighting ? mesh->normals.length() : 0);
+
+	int nbatches = (max(_vertices.length(), _normals.length()) + VERTEX_BATCH - 1) / VERTEX_BATCH;
 
-	for (int i = 0; i < _vertices.length(); i++)
-		_vertices[i] = _modelview * mesh->vertices[i];
+	parallelFor(nbatches, _threads, [=](int b) { transformVertices(*mesh, b * VERTEX_BATCH, (b + 1) * VERTEX_BATCH); });
 
-	for (int i = 0; i < _normals.length(); i++)
-		_normals[i] = _normalmat * mesh->normals[i];
-#endif
+	bool hastexcoords = mesh->texcoords.length() > 0 && mesh->texcoordsI.length() > 0;
 
 	for (int i = 0; i < mesh->indices.length(); i += 3)
 	{
 		int ia = mesh->indices[i];
 		int ib = mesh->indices[i + 1];
 		int ic = mesh->indices[i + 2];
-#ifndef PREMULT
-		Vec3 a = _modelview * mesh->vertices[ia];
-		Vec3 b = _modelview * mesh->vertices[ib];
-		Vec3 c = _modelview * mesh->vertices[ic];
-		Vec3 na = _normalmat * mesh->normals[mesh->normalsI[i]];
-		Vec3 nb = _normalmat * mesh->normals[mesh->normalsI[i + 1]];
-		Vec3 nc = _normalmat * mesh->normals[mesh->normalsI[i + 2]];
-#else
-		Vec3& a = _vertices[ia];
-		Vec3& b = _vertices[ib];
-		Vec3& c = _vertices[ic];
-		Vec3& na = _normals[mesh->normalsI[i]];
-		Vec3& nb = _normals[mesh->normalsI[i + 1]];
-		Vec3& nc = _normals[mesh->normalsI[i + 2]];
-#endif
-		if (mesh->texcoords.length() > 0 && mesh->texcoordsI.length() > 0)
+		int ca = _projected[ia].clip;
+		int cb = _projected[ib].clip;
+		int cc = _projected[ic].clip;
+		if ((ca | cb | cc) == 0)
 		{
-			Vec2 ta = mesh->texcoords[mesh->texcoordsI[i]];
-			Vec2 tb = mesh->texcoords[mesh->texcoordsI[i + 1]];
-			Vec2 tc = mesh->texcoords[mesh->texcoordsI[i + 2]];
-			paintTriangle(Vertex(a, na, ta), Vertex(b, nb, tb), Vertex(c, nc, tc));
+			paintMeshTriangle(*mesh, i, hastexcoords);
+			continue;
 		}
-		else
-			paintTriangle(Vertex(a, na), Vertex(b, nb), Vertex(c, nc));
+		if (ca & cb & cc) // outside one of the planes
+			continue;
+
+		// crossing the near or far planes or the guard band, will be clipped
+
+		Vertex v[3] = { Vertex(_vertices[ia]), Vertex(_vertices[ib]), Vertex(_vertices[ic]) };
+		if (_shading) // (in depth only passes normals and texture coordinates are not needed)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				if (_normals.length() > 0)
+					v[k].normal = _normals[mesh->normalsI[i + k]];
+				if (hastexcoords)
+					v[k].uv = mesh->texcoords[mesh->texcoordsI[i + k]];
+			}
+		}
+		clipTriangle(v, ca | cb | cc);
+	}
+
+	if (_binning)
+	{
+		flush();
+		_binning = false;
 	}
+	_meshCount++;
 }
 
-asl::Array2<asl::Vec3> Renderer::getImage() const
+// vertex stage of vertices and normals [i0, i1) of a mesh: positions are transformed to view space and projected
+// to pixel coordinates, and normals transformed with the normal matrix, SIMD_WIDTH at a time
+
+void Renderer::transformVertices(const TriMesh& mesh, int i0, int i1)
+{
+	typedef simd::Floats Floats;
+	const Matrix4& m = _modelview;
+	const Matrix4& p = _projection;
+	float w = (float)_depth.cols(), h = (float)_depth.rows();
+	float in[3][SIMD_WIDTH] = { { 0 } }, out[7][SIMD_WIDTH];
+
+	for (int i = i0; i < min(i1, _vertices.length()); i += SIMD_WIDTH)
+	{
+		int n = min(SIMD_WIDTH, _vertices.length() - i);
+		const Vec3* v = &mesh.vertices[i];
+		for (int l = 0; l < n; l++)
+		{
+			in[0][l] = v[l].x;
+			in[1][l] = v[l].y;
+			in[2][l] = v[l].z;
+		}
+		Floats x = Floats::load(in[0]), y = Floats::load(in[1]), z = Floats::load(in[2]);
+		Floats vx = x * m(0, 0) + y * m(0, 1) + z * m(0, 2) + m(0, 3);
+		Floats vy = x * m(1, 0) + y * m(1, 1) + z * m(1, 2) + m(1, 3);
+		Floats vz = x * m(2, 0) + y * m(2, 1) + z * m(2, 2) + m(2, 3);
+		Floats cx = vx * p(0, 0) + vy * p(0, 1) + vz * p(0, 2) + p(0, 3);
+		Floats cy = vx * p(1, 0) + vy * p(1, 1) + vz * p(1, 2) + p(1, 3);
+		Floats cz = vx * p(2, 0) + vy * p(2, 1) + vz * p(2, 2) + p(2, 3);
+		Floats cw = vx * p(3, 0) + vy * p(3, 1) + vz * p(3, 2) + p(3, 3);
+		Floats iw = Floats(1.f) / cw;
+		Floats nx = cx * iw, ny = cy * iw, nz = cz * iw;
+		Floats gw = cw * GUARD_BAND;
+		int codes[6] = { (cw + cz < 0.f).mask(), (cw - cz < 0.f).mask(), (gw + cx < 0.f).mask(),
+		                 (gw - cx < 0.f).mask(), (gw + cy < 0.f).mask(), (gw - cy < 0.f).mask() };
+		vx.store(out[0]);
+		vy.store(out[1]);
+		vz.store(out[2]);
+		((Floats(1.f) + nx) * (w / 2)).store(out[3]);
+		((Floats(1.f) - ny) * (h / 2)).store(out[4]);
+		nz.store(out[5]);
+		(Floats(-1.f) / vz).store(out[6]);
+		for (int l = 0; l < n; l++)
+		{
+			_vertices[i + l] = Vec3(out[0][l], out[1][l], out[2][l]);
+			ProjectedVertex& pv = _projected[i + l];
+			pv.p = Vec2(out[3][l], out[4][l]);
+			pv.z = out[5][l];
+			pv.iz = out[6][l];
+			pv.clip = 0;
+			for (int k = 0; k < 6; k++)
+				pv.clip |= ((codes[k] >> l) & 1) << k;
+		}
+	}
+
+	const Matrix4& nm = _normalmat; // affine, only its 3x3 part is used
+
+	for (int i = i0; i < min(i1, _normals.length()); i += SIMD_WIDTH)
+	{
+		int n = min(SIMD_WIDTH, _normals.length() - i);
+		const Vec3* v = &mesh.normals[i];
+		for (int l = 0; l < n; l++)
+		{
+			in[0][l] = v[l].x;
+			in[1][l] = v[l].y;
+			in[2][l] = v[l].z;
+		}
+		Floats x = Floats::load(in[0]), y = Floats::load(in[1]), z = Floats::load(in[2]);
+		(x * nm(0, 0) + y * nm(0, 1) + z * nm(0, 2)).store(out[0]);
+		(x * nm(1, 0) + y * nm(1, 1) + z * nm(1, 2)).store(out[1]);
+		(x * nm(2, 0) + y * nm(2, 1) + z * nm(2, 2)).store(out[2]);
+		for (int l = 0; l < n; l++)
+			_normals[i + l] = Vec3(out[0][l], out[1][l], out[2][l]);
+	}
+}
+
+const asl::Array2<asl::Vec3>& Renderer::getRangeImage()
 {
-	return _image;
+	getRangeImage(_points);
+	return _points;
 }
 
-asl::Array2<asl::Vec3> Renderer::getRangeImage()
+void Renderer::getRangeImage(Array2<Vec3>& points) const
 {
 	bool persp = _projection(3, 3) == 0;
 	float zfar = persp ? _projection(2, 3) / (_projection(2, 2) + 1) : (_projection(2, 3) - 1) / _projection(2, 2);
 	float fardepth = persp ? zfar : 1.0f;
 	float neardepth = persp ? _znear : -1.0f;
-	_points.resize(_depth.rows(), _depth.cols());
-	float w = (float)_image.cols();
-	float h = (float)_image.rows();
+	if (points.rows() != _depth.rows() || points.cols() != _depth.cols())
+		points.resize(_depth.rows(), _depth.cols());
+	float w = (float)_depth.cols();
+	float h = (float)_depth.rows();
 
 	for (int i = 0; i < _depth.rows(); i++)
 		for (int j = 0; j < _depth.cols(); j++)
 		{
 			if (_depth(i, j) > fardepth)
-				_points(i, j) = Vec3(0, 0, 0);
+				points(i, j) = Vec3(0, 0, 0);
 			else
 			{
 				float u = (j + 0.5f) / (w / 2) - 1;
@@ -407,11 +1449,9 @@ asl::Array2<asl::Vec3> Renderer::getRangeImage()
 				float z = -_depth(i, j);
 				float x = -(u + _projection(0, 2)) * z / _projection(0, 0);
 				float y = -(v + _projection(1, 2)) * z / _projection(1, 1);
-				_points(i, j) = Vec3(x, y, z);
+				points(i, j) = Vec3(x, y, z);
 			}
 		}
-
-	return _points;
 }
 
 }
@@ -1,4 +1,9 @@
 #include "minirender/Scene.h"
+#include "parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string.h>
 
 using namespace asl;
 
@@ -22,8 +27,9 @@ void SceneNode::collectShapes(Array<Renderable>& list, const asl::Matrix4& xform
 BBox SceneNode::getBbox(const asl::Matrix4& xform) const
 {
 	BBox box;
+	Matrix4 m = xform * transform;
 	for (auto& node : children)
-		box += node->getBbox(xform * transform);
+		box += node->getBbox(m);
 	return box;
 }
 
@@ -37,17 +43,34 @@ void TriMesh::collectShapes(asl::Array<Renderable>& list, const asl::Matrix4& xf
 
 BBox TriMesh::getBbox(const asl::Matrix4& xform) const
 {
-	BBox box;
-	for (auto& p : vertices)
-		box += xform * transform * p;
+	Matrix4 m = xform * transform;
+	BBox box = transformBox(getLocalBbox(), m);
 	for (auto& node : children)
-		box += node->getBbox(xform * transform);
+		box += node->getBbox(m);
 	return box;
 }
 
+const BBox& TriMesh::getLocalBbox() const
+{
+	const Vec3* data = vertices.length() > 0 ? &vertices[0] : 0;
+	if (!_bboxValid || data != _bboxVertices || vertices.length() != _bboxCount)
+	{
+		_bbox = BBox();
+		for (auto& p : vertices)
+			_bbox += p;
+		_bboxVertices = data;
+		_bboxCount = vertices.length();
+		_bboxValid = true;
+	}
+	return _bbox;
+}
+
 TriMesh::TriMesh()
 {
 	material = NULL;
+	_bboxVertices = 0;
+	_bboxCount = 0;
+	_bboxValid = false;
 }
 
 void TriMesh::applyTransform()
@@ -60,6 +83,155 @@ void TriMesh::applyTransform()
 		n = (invTrans % n).normalized();
 
 	transform = Matrix4::identity();
+	invalidateBbox();
+}
+
+#define MAX_WELD_VERTICES (1 << 29)
+
+// welding: each vertex gets a grid cell (the float bits with epsilon 0) and is inserted in a lock-free hash table of
+// cells, which keeps the lowest vertex index of each cell. Then the first vertices of the cells are numbered in order
+// (prefix sums per chunk), so the result does not depend on thread timing
+
+void TriMesh::weldVertices(float epsilon, bool smoothNormals)
+{
+	const int chunk = 1 << 16;
+	int n = vertices.length();
+	int nchunks = (n + chunk - 1) / chunk;
+	int threads = hardwareThreads();
+	if (n == 0 || n > MAX_WELD_VERTICES) // (3 cells per vertex and a table of 2n slots rounded up must fit an int)
+		return;
+
+	Array<int> cells(n * 3);
+	parallelFor(nchunks, threads, [&](int k) {
+		for (int i = k * chunk; i < min(n, (k + 1) * chunk); i++)
+		{
+			const Vec3& p = vertices[i];
+			for (int j = 0; j < 3; j++)
+			{
+				float x = (&p.x)[j];
+				int c;
+				if (epsilon > 0)
+				{
+					x = floorf(x / epsilon + 0.5f);
+					c = x > -2e9f && x < 2e9f ? int(x) : 0x7fffffff;
+				}
+				else
+				{
+					x += 0.0f; // -0 as 0
+					memcpy(&c, &x, 4);
+				}
+				cells[i * 3 + j] = c;
+			}
+		}
+	});
+
+	int size = 1;
+	while (size < 2 * n)
+		size *= 2;
+	std::unique_ptr<std::atomic<int>[]> table(new std::atomic<int>[size]); // first vertex + 1 of a cell, 0 if empty
+	Array<int> first(n); // the slot of each vertex, then the first vertex of its cell
+
+	parallelFor((size + chunk - 1) / chunk, threads, [&](int k) {
+		for (int i = k * chunk; i < min(size, (k + 1) * chunk); i++)
+			table[i].store(0, std::memory_order_relaxed);
+	});
+
+	auto sameCell = [&](int a, int b) {
+		return cells[a * 3] == cells[b * 3] && cells[a * 3 + 1] == cells[b * 3 + 1] && cells[a * 3 + 2] == cells[b * 3 + 2];
+	};
+
+	parallelFor(nchunks, threads, [&](int k) {
+		for (int i = k * chunk; i < min(n, (k + 1) * chunk); i++)
+		{
+			unsigned h = (unsigned)cells[i * 3] * 73856093u ^ (unsigned)cells[i * 3 + 1] * 19349663u ^ (unsigned)cells[i * 3 + 2] * 83492791u;
+			int slot = (h ^ (h >> 15)) & (size - 1);
+			while (true)
+			{
+				int v = table[slot].load();
+				if (v == 0)
+				{
+					if (table[slot].compare_exchange_strong(v, i + 1))
+						break;
+				}
+				if (v != 0 && sameCell(v - 1, i))
+				{
+					while (i + 1 < v && !table[slot].compare_exchange_weak(v, i + 1)) {}
+					break;
+				}
+				if (v != 0)
+					slot = (slot + 1) & (size - 1);
+			}
+			first[i] = slot;
+		}
+	});
+
+	Array<int> counts(nchunks + 1);
+	parallelFor(nchunks, threads, [&](int k) {
+		int count = 0;
+		for (int i = k * chunk; i < min(n, (k + 1) * chunk); i++)
+		{
+			first[i] = table[first[i]].load(std::memory_order_relaxed) - 1;
+			if (first[i] == i)
+				count++;
+		}
+		counts[k + 1] = count;
+	});
+	table.reset();
+	counts[0] = 0;
+	for (int k = 0; k < nchunks; k++)
+		counts[k + 1] += counts[k];
+
+	Array<int> remap(n);
+	Array<Vec3> welded(counts[nchunks]);
+	parallelFor(nchunks, threads, [&](int k) {
+		int index = counts[k];
+		for (int i = k * chunk; i < min(n, (k + 1) * chunk); i++)
+			if (first[i] == i)
+			{
+				welded[index] = vertices[i];
+				remap[i] = index++;
+			}
+	});
+	parallelFor(nchunks, threads, [&](int k) {
+		for (int i = k * chunk; i < min(n, (k + 1) * chunk); i++)
+			if (first[i] != i)
+				remap[i] = remap[first[i]];
+	});
+
+	int ni = indices.length();
+	Array<int> newIndices(ni);
+	parallelFor((ni + chunk - 1) / chunk, threads, [&](int k) {
+		for (int i = k * chunk; i < min(ni, (k + 1) * chunk); i++)
+			newIndices[i] = remap[indices[i]];
+	});
+
+	if (smoothNormals)
+	{
+		// area weighted triangle normals (front faces counterclockwise), flipped where the current normals disagree
+		Array<Vec3> vnormals(welded.length(), Vec3(0, 0, 0));
+		bool oriented = normals.length() > 0 && normalsI.length() == ni;
+		for (int i = 0; i + 2 < ni; i += 3)
+		{
+			const Vec3& a = welded[newIndices[i]];
+			Vec3 nt = (welded[newIndices[i + 1]] - a) ^ (welded[newIndices[i + 2]] - a);
+			if (oriented && nt * (normals[normalsI[i]] + normals[normalsI[i + 1]] + normals[normalsI[i + 2]]) < 0)
+				nt = -nt;
+			for (int j = 0; j < 3; j++)
+				vnormals[newIndices[i + j]] += nt;
+		}
+		parallelFor((vnormals.length() + chunk - 1) / chunk, threads, [&](int k) {
+			for (int i = k * chunk; i < min(vnormals.length(), (k + 1) * chunk); i++)
+			{
+				float l = vnormals[i].length();
+				vnormals[i] = l > 0 ? vnormals[i] / l : Vec3(0, 0, 1);
+			}
+		});
+		normals = vnormals;
+		normalsI = newIndices;
+	}
+
+	vertices = welded;
+	indices = newIndices;
 }
 
 Material::Material() :
@@ -67,12 +239,350 @@ Material::Material() :
 	specular(0.8f, 0.8f, 0.8f),
 	emissive(0, 0, 0),
 	shininess(12.0f),
-	opacity(1.0f)
+	opacity(1.0f),
+	_texturePixels(0),
+	_textureRows(0),
+	_textureCols(0),
+	_textureValid(false)
 {}
 
+const Texture& Material::getTexture() const
+{
+	const Vec3* pixels = texture.rows() > 0 ? &texture(0, 0) : 0;
+	if (_textureFile && _textureFile->image.rows() > 0 && pixels == &_textureFile->image(0, 0) &&
+	    texture.rows() == _textureFile->image.rows() && texture.cols() == _textureFile->image.cols())
+		return _textureFile->texture;
+	if (!_textureValid || pixels != _texturePixels || texture.rows() != _textureRows || texture.cols() != _textureCols)
+	{
+		_texture = Texture(texture);
+		_texturePixels = pixels;
+		_textureRows = texture.rows();
+		_textureCols = texture.cols();
+		_textureValid = true;
+	}
+	return _texture;
+}
+
+void Material::setTexture(const Shared<TextureFile>& file)
+{
+	_textureFile = file;
+	texture = file ? file->image : Array2<Vec3>();
+}
+
 Scene::Scene()
 {
 	ambientLight = 0.1f;
+	_changed = true;
+}
+
+inline bool sameTransform(const Matrix4& a, const Matrix4& b)
+{
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 4; j++)
+			if (a(i, j) != b(i, j))
+				return false;
+	return true;
+}
+
+void Scene::saveNodes(const SceneNode* node, Map<const SceneNode*, bool>& saved)
+{
+	if (saved.has(node)) // instanced, already saved
+		return;
+	saved[node] = true;
+	NodeState state;
+	state.node = node;
+	state.mesh = dynamic_cast<const TriMesh*>(node);
+	state.transform = node->transform;
+	state.first = _nodeChildren.length();
+	state.count = node->children.length();
+	state.vertices = state.mesh && state.mesh->vertices.length() > 0 ? &state.mesh->vertices[0] : 0;
+	state.nvertices = state.mesh ? state.mesh->vertices.length() : 0;
+	_nodes << state;
+	for (auto& child : node->children)
+		_nodeChildren << child.ptr();
+	for (auto& child : node->children)
+		saveNodes(child.ptr(), saved);
+}
+
+// the saved nodes are checked in depth first order, so each is known to be still in the graph (and alive) because its
+// parent was checked before
+
+bool Scene::changed() const
+{
+	for (auto& state : _nodes)
+	{
+		const SceneNode* node = state.node;
+		if (!sameTransform(node->transform, state.transform) || node->children.length() != state.count)
+			return true;
+		for (int i = 0; i < state.count; i++)
+			if (node->children[i].ptr() != _nodeChildren[state.first + i])
+				return true;
+		if (const TriMesh* mesh = state.mesh)
+		{
+			const Vec3* vertices = mesh->vertices.length() > 0 ? &mesh->vertices[0] : 0;
+			if (vertices != state.vertices || mesh->vertices.length() != state.nvertices || !mesh->_bboxValid)
+				return true;
+		}
+	}
+	return false;
+}
+
+void Scene::updateBvh()
+{
+	if (!_changed && !changed())
+		return;
+	_changed = false;
+	_nodes.clear();
+	_nodeChildren.clear();
+	Map<const SceneNode*, bool> saved;
+	saveNodes(this, saved);
+	_shapes.clear();
+	collectShapes(_shapes, Matrix4::identity());
+
+	bool same = _shapes.length() == _bvh.items.length();
+	for (int i = 0; same && i < _shapes.length(); i++)
+		same = _shapes[i].mesh == _bvh.items[i].mesh;
+
+	if (!same)
+	{
+		_bvh.build(_shapes);
+		return;
+	}
+
+	for (int i = 0; i < _shapes.length(); i++)
+	{
+		const BBox& box = _shapes[i].mesh->getLocalBbox();
+		if (!sameTransform(_shapes[i].transform, _bvh.items[i].transform) || !(box.pmin == _bvh.local[i].pmin) ||
+		    !(box.pmax == _bvh.local[i].pmax))
+			_bvh.refit(i, _shapes[i].transform);
+	}
+}
+
+PickResult Scene::pick(const Ray& ray)
+{
+	updateBvh();
+	return _bvh.pick(ray);
+}
+
+BBox transformBox(const BBox& box, const Matrix4& m)
+{
+	BBox b;
+	if (box.pmin.x > box.pmax.x)
+		return b;
+	for (int k = 0; k < 8; k++)
+		b += m * Vec3((k & 1) ? box.pmax.x : box.pmin.x, (k & 2) ? box.pmax.y : box.pmin.y, (k & 4) ? box.pmax.z : box.pmin.z);
+	return b;
+}
+
+int frustumTest(const BBox& box, const Matrix4& m)
+{
+	if (box.pmin.x > box.pmax.x)
+		return -1;
+
+	int out[6] = { 0, 0, 0, 0, 0, 0 };
+	for (int k = 0; k < 8; k++)
+	{
+		Vec3 p((k & 1) ? box.pmax.x : box.pmin.x, (k & 2) ? box.pmax.y : box.pmin.y, (k & 4) ? box.pmax.z : box.pmin.z);
+		Vec4 q = m * Vec4(p, 1.0f);
+		out[0] += q.x < -q.w;
+		out[1] += q.x > q.w;
+		out[2] += q.y < -q.w;
+		out[3] += q.y > q.w;
+		out[4] += q.z < -q.w;
+		out[5] += q.z > q.w;
+	}
+	bool inside = true;
+	for (int i = 0; i < 6; i++)
+	{
+		if (out[i] == 8)
+			return -1;
+		if (out[i] > 0)
+			inside = false;
+	}
+	return inside ? 1 : 0;
+}
+
+void Bvh::build(const Array<Renderable>& shapes)
+{
+	items = shapes.clone();
+	nodes.clear();
+	leaves.resize(items.length());
+	local.resize(items.length());
+	if (items.length() == 0)
+		return;
+	nodes.reserve(2 * items.length() - 1);
+	_boxes.resize(items.length());
+	Array<int> indices(items.length());
+	for (int i = 0; i < items.length(); i++)
+	{
+		indices[i] = i;
+		local[i] = items[i].mesh->getLocalBbox();
+		_boxes[i] = transformBox(local[i], items[i].transform);
+	}
+	build(&indices[0], indices.length(), -1);
+	_boxes.clear();
+}
+
+// builds the subtree of n items splitting them at the median of the longest axis of their box centers
+
+int Bvh::build(int* index, int n, int parent)
+{
+	int k = nodes.length();
+	nodes << Node();
+	nodes[k].parent = parent;
+
+	if (n == 1)
+	{
+		nodes[k].box = _boxes[index[0]];
+		nodes[k].left = nodes[k].right = -1;
+		nodes[k].item = index[0];
+		leaves[index[0]] = k;
+		return k;
+	}
+
+	BBox centers;
+	for (int i = 0; i < n; i++)
+		if (_boxes[index[i]].pmin.x <= _boxes[index[i]].pmax.x)
+			centers += _boxes[index[i]].center();
+	Vec3 size = centers.size();
+	int axis = (size.x > size.y && size.x > size.z) ? 0 : (size.y > size.z) ? 1 : 2;
+
+	auto key = [&](int i) { // center coordinate (empty meshes at 0)
+		const BBox& b = _boxes[i];
+		return b.pmin.x > b.pmax.x ? 0.f : (&b.pmin.x)[axis] + (&b.pmax.x)[axis];
+	};
+
+	std::nth_element(index, index + n / 2, index + n, [&](int a, int b) { return key(a) < key(b); });
+
+	int left = build(index, n / 2, k);
+	int right = build(index + n / 2, n - n / 2, k);
+	nodes[k].left = left;
+	nodes[k].right = right;
+	nodes[k].item = -1;
+	nodes[k].box = nodes[left].box;
+	nodes[k].box += nodes[right].box;
+	return k;
+}
+
+void Bvh::refit(int item, const Matrix4& transform)
+{
+	items[item].transform = transform;
+	local[item] = items[item].mesh->getLocalBbox();
+	int k = leaves[item];
+	nodes[k].box = transformBox(local[item], transform);
+	for (k = nodes[k].parent; k >= 0; k = nodes[k].parent)
+	{
+		nodes[k].box = nodes[nodes[k].left].box;
+		nodes[k].box += nodes[nodes[k].right].box;
+	}
+}
+
+void Bvh::cull(const Matrix4& viewproj, Array<int>& visible) const
+{
+	if (nodes.length() > 0)
+		cull(0, viewproj, false, visible);
+}
+
+void Bvh::cull(int k, const Matrix4& viewproj, bool inside, Array<int>& visible) const
+{
+	const Node& node = nodes[k];
+	if (!inside)
+	{
+		int test = frustumTest(node.box, viewproj);
+		if (test < 0)
+			return;
+		inside = test > 0;
+	}
+	if (node.left < 0)
+		visible << node.item;
+	else
+	{
+		cull(node.left, viewproj, inside, visible);
+		cull(node.right, viewproj, inside, visible);
+	}
+}
+
+// ray parameter where the ray enters a box (or infinity if it misses it before tmax)
+
+inline float rayBox(const Ray& ray, const Vec3& invdir, const BBox& box, float tmax)
+{
+	float t0 = 0, t1 = tmax;
+	for (int i = 0; i < 3; i++)
+	{
+		float o = (&ray.origin.x)[i];
+		float ta = ((&box.pmin.x)[i] - o) * (&invdir.x)[i];
+		float tb = ((&box.pmax.x)[i] - o) * (&invdir.x)[i];
+		if (ta > tb)
+			swap(ta, tb);
+		t0 = max(t0, ta);
+		t1 = min(t1, tb);
+		if (t0 > t1)
+			return infinity();
+	}
+	return t0;
+}
+
+PickResult Bvh::pick(const Ray& ray) const
+{
+	PickResult hit;
+	if (nodes.length() == 0)
+		return hit;
+
+	Vec3 invdir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	Array<int> stack;
+	stack << 0;
+
+	while (stack.length() > 0)
+	{
+		const Node& node = nodes[stack.last()];
+		stack.removeLast();
+		if (rayBox(ray, invdir, node.box, hit.t) == infinity())
+			continue;
+
+		if (node.left >= 0)
+		{
+			stack << node.left << node.right;
+			continue;
+		}
+
+		// intersect the mesh triangles in its own coordinates (Moller-Trumbore)
+
+		const TriMesh& mesh = *items[node.item].mesh;
+		Matrix4 inv = items[node.item].transform.inverse();
+		Vec3 o = inv * ray.origin, d = inv % ray.direction;
+
+		for (int i = 0; i < mesh.indices.length(); i += 3)
+		{
+			const Vec3& a = mesh.vertices[mesh.indices[i]];
+			Vec3 e1 = mesh.vertices[mesh.indices[i + 1]] - a;
+			Vec3 e2 = mesh.vertices[mesh.indices[i + 2]] - a;
+			Vec3 p = d ^ e2;
+			float det = e1 * p;
+			if (fabs(det) < 1e-12f)
+				continue;
+			float idet = 1 / det;
+			Vec3 s = o - a;
+			float u = (s * p) * idet;
+			if (u < 0 || u > 1)
+				continue;
+			Vec3 q = s ^ e1;
+			float v = (d * q) * idet;
+			if (v < 0 || u + v > 1)
+				continue;
+			float t = (e2 * q) * idet;
+			if (t > 0 && t < hit.t)
+			{
+				hit.t = t;
+				hit.mesh = items[node.item].mesh;
+				hit.transform = items[node.item].transform;
+				hit.triangle = i / 3;
+			}
+		}
+	}
+
+	if (hit.mesh)
+		hit.point = ray.origin + hit.t * ray.direction;
+	return hit;
 }
 
 }
@@ -0,0 +1,252 @@
+#include <minirender/Texture.h>
+#include "simd.h"
+
+using namespace asl;
+
+namespace minirender {
+
+// a color as 8-bit RGBA (0xAABBGGRR), rounded
+
+inline unsigned packTexel(const Vec3& c)
+{
+	return (unsigned)(clamp(c.x * 255.0f + 0.5f, 0.0f, 255.0f)) | ((unsigned)(clamp(c.y * 255.0f + 0.5f, 0.0f, 255.0f)) << 8) |
+	       ((unsigned)(clamp(c.z * 255.0f + 0.5f, 0.0f, 255.0f)) << 16) | 0xff000000u;
+}
+
+Texture::Texture(const Array2<Vec3>& image)
+{
+	if (image.rows() == 0 || image.cols() == 0)
+		return;
+
+	Array2<Vec3> img = image;
+
+	while (true)
+	{
+		int w = img.cols(), h = img.rows();
+		Level level;
+		level.w = w;
+		level.h = h;
+		level.tiles = (w + 3) / 4;
+		level.texels.resize(level.tiles * ((h + 3) / 4) * 16);
+		for (int y = 0; y < h; y++)
+			for (int x = 0; x < w; x++)
+				level.texels[level.index(x, y)] = packTexel(img(y, x));
+		_levels << level;
+
+		if (w == 1 && h == 1)
+			break;
+
+		// next level: averages of 2x2 texels (repeating the last row or column of odd sizes)
+
+		Array2<Vec3> next(max(h / 2, 1), max(w / 2, 1));
+		for (int i = 0; i < next.rows(); i++)
+		{
+			int i0 = min(2 * i, h - 1), i1 = min(2 * i + 1, h - 1);
+			for (int j = 0; j < next.cols(); j++)
+			{
+				int j0 = min(2 * j, w - 1), j1 = min(2 * j + 1, w - 1);
+				next(i, j) = (img(i0, j0) + img(i0, j1) + img(i1, j0) + img(i1, j1)) * 0.25f;
+			}
+		}
+		img = next;
+	}
+}
+
+size_t Texture::memory() const
+{
+	size_t bytes = 0;
+	for (auto& level : _levels)
+		bytes += level.texels.length() * sizeof(unsigned);
+	return bytes;
+}
+
+// texture coordinates are wrapped to [0, 1] (garbage if huge or NaN, which the texel lookups clamp), and bilinear
+// interpolation is done in fixed point, with positions in 1/256 texels from the texel centers
+
+void Texture::sample(int n, int mask, const float* u, const float* v, float lod, Filter filter, float* r, float* g,
+                     float* b) const
+{
+	typedef simd::Floats Floats;
+	typedef simd::Ints Ints;
+
+	int last = _levels.length() - 1;
+	if (!(lod > 0)) // magnified (or NaN)
+		lod = 0;
+	else if (lod > last)
+		lod = (float)last;
+	int l = filter == TRILINEAR ? int(lod) : int(lod + 0.5f);
+	float f = filter == TRILINEAR ? lod - l : 0.f;
+
+	if (filter == NEAREST)
+	{
+		const Level& level = _levels[l];
+		for (int i = 0; i < n; i++)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+			int x = int(fract(u[i]) * level.w), y = int(fract(v[i]) * level.h);
+			if (x < 0 || x >= level.w)
+				x = level.w - 1;
+			if (y < 0 || y >= level.h)
+				y = level.h - 1;
+			unsigned c = level.texels[level.index(x, y)];
+			r[i] = float(c & 0xff) * (1 / 255.0f);
+			g[i] = float((c >> 8) & 0xff) * (1 / 255.0f);
+			b[i] = float((c >> 16) & 0xff) * (1 / 255.0f);
+		}
+		return;
+	}
+
+	// a texel coordinate and the next one (wrapping around), clamped to [0, size)
+	auto texelPair = [](Floats x, int size, Ints& x0, Ints& x1, Floats& a) {
+		Ints xi = Ints::convert(x * float(size << 8)) - 128;
+		a = (xi & 255).toFloats() * (1 / 256.0f);
+		x0 = xi >> 8;
+		Ints out = (x0 >> 31) | ((Ints(size - 1) - x0) >> 31);
+		x0 = x0 + ((Ints(size - 1) - x0) & out);
+		x1 = x0 + 1;
+		x1 = x1 & ((x1 - size) >> 31);
+	};
+
+	// (only the m lanes of pixels are gathered)
+	auto bilinear = [&](const Level& level, Floats x, Floats y, int m, Floats c[3]) {
+		Ints x0, x1, y0, y1;
+		Floats ax, ay;
+		texelPair(x, level.w, x0, x1, ax);
+		texelPair(y, level.h, y0, y1, ay);
+		int cols[2][SIMD_WIDTH], rows[2][SIMD_WIDTH], t[4][SIMD_WIDTH] = {};
+		(((x0 >> 2) << 4) | (x0 & 3)).store(cols[0]);
+		(((x1 >> 2) << 4) | (x1 & 3)).store(cols[1]);
+		(y0 >> 2).store(rows[0]);
+		(y1 >> 2).store(rows[1]);
+		(y0 & 3).store(t[0]);
+		(y1 & 3).store(t[1]);
+		for (int i = 0; i < m; i++)
+		{
+			rows[0][i] = ((rows[0][i] * level.tiles) << 4) | (t[0][i] << 2);
+			rows[1][i] = ((rows[1][i] * level.tiles) << 4) | (t[1][i] << 2);
+		}
+		const unsigned* texels = level.texels.ptr();
+		for (int i = 0; i < m; i++)
+		{
+			t[0][i] = texels[rows[0][i] + cols[0][i]];
+			t[1][i] = texels[rows[0][i] + cols[1][i]];
+			t[2][i] = texels[rows[1][i] + cols[0][i]];
+			t[3][i] = texels[rows[1][i] + cols[1][i]];
+		}
+		Ints t00 = Ints::load(t[0]), t01 = Ints::load(t[1]), t10 = Ints::load(t[2]), t11 = Ints::load(t[3]);
+		for (int k = 0; k < 3; k++)
+		{
+			Floats c00 = (t00 & 255).toFloats(), c01 = (t01 & 255).toFloats();
+			Floats c10 = (t10 & 255).toFloats(), c11 = (t11 & 255).toFloats();
+			Floats c0 = c00 + (c01 - c00) * ax, c1 = c10 + (c11 - c10) * ax;
+			c[k] = (c0 + (c1 - c0) * ay) * (1 / 255.0f);
+			t00 = t00 >> 8;
+			t01 = t01 >> 8;
+			t10 = t10 >> 8;
+			t11 = t11 >> 8;
+		}
+	};
+
+	// one or two pixels (as in most groups of tiny triangles) are filtered one by one, in integers: red and blue
+	// together in 32-bit halves. The float interpolation below is exact until the division by 255, so this gives the
+	// same colors
+	int few = n < 32 ? mask & ((1 << n) - 1) : mask;
+	few &= few - 1; // (clears the lowest two bits set)
+	few &= few - 1;
+	if (few == 0)
+	{
+		auto texelPair1 = [](float x, int size, int& x0, int& x1, unsigned& a) {
+			int xi = int(x * float(size << 8)) - 128;
+			a = xi & 255;
+			x0 = xi >> 8;
+			if (x0 < 0 || x0 >= size)
+				x0 = size - 1;
+			x1 = x0 + 1 < size ? x0 + 1 : 0;
+		};
+		auto bilinear1 = [&](const Level& level, float x, float y, float c[3]) {
+			int x0, x1, y0, y1;
+			unsigned ax, ay;
+			texelPair1(x, level.w, x0, x1, ax);
+			texelPair1(y, level.h, y0, y1, ay);
+			const unsigned* row0 = level.texels.ptr() + level.index(0, y0);
+			const unsigned* row1 = level.texels.ptr() + level.index(0, y1);
+			int col0 = level.index(x0, 0), col1 = level.index(x1, 0);
+			unsigned t00 = row0[col0], t01 = row0[col1], t10 = row1[col0], t11 = row1[col1];
+			auto rb = [](unsigned t) { return (t & 0xff) | ((unsigned long long)(t & 0xff0000) << 16); };
+			unsigned long long rb0 = rb(t00) * (256 - ax) + rb(t01) * ax, rb1 = rb(t10) * (256 - ax) + rb(t11) * ax;
+			unsigned long long crb = rb0 * (256 - ay) + rb1 * ay;
+			unsigned g0 = ((t00 >> 8) & 255) * (256 - ax) + ((t01 >> 8) & 255) * ax;
+			unsigned g1 = ((t10 >> 8) & 255) * (256 - ax) + ((t11 >> 8) & 255) * ax;
+			const float k = (1 / 255.0f) * (1 / 65536.0f);
+			c[0] = float(unsigned(crb)) * k;
+			c[1] = float(g0 * (256 - ay) + g1 * ay) * k;
+			c[2] = float(unsigned(crb >> 32)) * k;
+		};
+		for (int i = 0; i < n; i++)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+			float x = u[i] - float(int(u[i])), y = v[i] - float(int(v[i]));
+			x = x < 0 ? x + 1 : x;
+			y = y < 0 ? y + 1 : y;
+			if (!(x >= 0 && x <= 1 && y >= 0 && y <= 1)) // huge or NaN
+				x = y = 0;
+			float c[3];
+			bilinear1(_levels[l], x, y, c);
+			if (f > 0)
+			{
+				float c2[3];
+				bilinear1(_levels[l + 1], x, y, c2);
+				for (int k = 0; k < 3; k++)
+					c[k] = c[k] + (c2[k] - c[k]) * f;
+			}
+			r[i] = c[0];
+			g[i] = c[1];
+			b[i] = c[2];
+		}
+		return;
+	}
+
+	for (int i = 0; i < n; i += SIMD_WIDTH)
+	{
+		int m = min(SIMD_WIDTH, n - i);
+		Floats x = m == SIMD_WIDTH ? Floats::load(u + i) : simd::loadPartial(u + i, m);
+		Floats y = m == SIMD_WIDTH ? Floats::load(v + i) : simd::loadPartial(v + i, m);
+		x = x - Ints::convert(x).toFloats();
+		y = y - Ints::convert(y).toFloats();
+		x = x + (Floats(1.f) & (x < 0.f));
+		y = y + (Floats(1.f) & (y < 0.f));
+
+		Floats c[3];
+		bilinear(_levels[l], x, y, m, c);
+		if (f > 0)
+		{
+			Floats c2[3];
+			bilinear(_levels[l + 1], x, y, m, c2);
+			for (int k = 0; k < 3; k++)
+				c[k] = c[k] + (c2[k] - c[k]) * f;
+		}
+
+		float rgb[3][SIMD_WIDTH];
+		for (int k = 0; k < 3; k++)
+			c[k].store(rgb[k]);
+		for (int j = 0; j < m; j++)
+		{
+			r[i + j] = rgb[0][j];
+			g[i + j] = rgb[1][j];
+			b[i + j] = rgb[2][j];
+		}
+	}
+}
+
+Vec3 Texture::sample(const Vec2& uv, float lod, Filter filter) const
+{
+	if (_levels.length() == 0)
+		return Vec3(1, 1, 1);
+	Vec3 c;
+	sample(1, 1, &uv.x, &uv.y, lod, filter, &c.x, &c.y, &c.z);
+	return c;
+}
+
+}
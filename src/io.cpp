@@ -3,15 +3,16 @@
 #include <asl/Map.h>
 #include <asl/Path.h>
 #include "minirender/io.h"
+#include "mapped.h"
+#include "parallel.h"
+#include <mutex>
+#include <string.h>
 
 using namespace asl;
 
-#define OBJ_TRI
-
 namespace minirender
 {
 Shared<SceneNode> loadX3D(const asl::String& filename);
-Array<int>        triangulateIndices(const Array<int>& indices);
 
 Shared<TriMesh> loadSTLa(const asl::String& filename)
 {
@@ -60,51 +61,43 @@ Shared<TriMesh> loadSTLa(const asl::String& filename)
 	return obj;
 }
 
-Shared<TriMesh> loadSTLb(const String& filename)
-{
-	File file(filename, File::READ);
-	if (!file)
-		return NULL;
+// binary STL: an 80 byte header, the facet count and 50 byte facets (normal, 3 vertices and 2 attribute bytes), decoded
+// in parallel chunks from the mapped file straight into the mesh arrays (floats are little endian, as on all hosts
+// supported)
 
-	char s[88];
-	if (file.read(s, 80) != 80)
-		return NULL;
-
-	int nf = file.read<int>();
-
-	if (nf > 100000000)
-		return NULL;
+Shared<TriMesh> loadSTLb(const MappedFile& file)
+{
+	const int chunk = 1 << 16;
+	const char* data = file.data() + 84;
+	int nf;
+	memcpy(&nf, file.data() + 80, 4);
 
 	Shared<TriMesh> obj = new TriMesh();
 
-	Array<byte> data(3 * sizeof(float) + 3 * 3 * sizeof(float) + 2);
-
-	obj->normals.reserve(nf);
-	obj->vertices.reserve(nf * 3);
-	obj->indices.reserve(nf * 3);
-	obj->normalsI.reserve(nf * 3);
+	obj->normals.resize(nf);
+	obj->vertices.resize(nf * 3);
+	obj->indices.resize(nf * 3);
+	obj->normalsI.resize(nf * 3);
 
-	Vec3 v;
+	Vec3* normals = obj->normals.ptr();
+	Vec3* vertices = obj->vertices.ptr();
+	int* indices = obj->indices.ptr();
+	int* normalsI = obj->normalsI.ptr();
 
-	int indexn = 0, indexv = 0;
-	for (int i = 0; i < nf; i++, indexn++)
-	{
-		file.read(data.ptr(), data.length());
-		StreamBufferReader reader(data);
-		reader >> v.x >> v.y >> v.z;
-		obj->normals << v;
-
-		for (int j = 0; j < 3; j++, indexv++)
+	parallelFor((nf + chunk - 1) / chunk, hardwareThreads(), [&](int k) {
+		int i1 = min(nf, (k + 1) * chunk);
+		for (int i = k * chunk; i < i1; i++)
 		{
-			reader >> v.x >> v.y >> v.z;
-			obj->vertices << v;
+			const char* facet = data + (size_t)i * 50;
+			memcpy(&normals[i], facet, 12);
+			for (int j = 0; j < 3; j++)
+			{
+				memcpy(&vertices[i * 3 + j], facet + 12 + j * 12, 12);
+				indices[i * 3 + j] = i * 3 + j;
+				normalsI[i * 3 + j] = i;
+			}
 		}
-
-		obj->indices << indexv - 3 << indexv - 2 << indexv - 1;
-		obj->normalsI << indexn << indexn << indexn;
-
-		reader.skip(2);
-	}
+	});
 
 	return obj;
 }
@@ -131,26 +124,31 @@ Shared<SceneNode> loadMesh(const asl::String& filename)
 	return new SceneNode;
 }
 
-Shared<TriMesh> loadSTL(const asl::String& filename)
+Shared<TriMesh> loadSTL(const asl::String& filename, bool weld, bool smoothNormals, float epsilon)
 {
-	Array<byte> bytes = File(filename).firstBytes(5);
-	if (bytes.length() < 5)
-		return NULL;
+	Shared<TriMesh> mesh;
 
-	bool binary = false;
-	if (File(filename).size() > 84)
+	// binary if the size matches the facet count (with 3 indices per facet fitting an int), ASCII otherwise
 	{
-		File file(filename, File::READ);
-		file.seek(80);
-		int nf = file.read<int>();
-		if (file.size() == 80 + 4 + nf * 50)
-			binary = true;
+		MappedFile file(filename);
+		if (file.size() < 5)
+			return NULL;
+
+		if (file.size() >= 84)
+		{
+			unsigned nf;
+			memcpy(&nf, file.data() + 80, 4);
+			if (nf < (1u << 31) / 3 && file.size() == 84 + (unsigned long long)nf * 50)
+				mesh = loadSTLb(file);
+		}
 	}
 
-	if (!binary)
-		return loadSTLa(filename);
-	else
-		return loadSTLb(filename);
+	if (!mesh)
+		mesh = loadSTLa(filename);
+
+	if (mesh && weld)
+		mesh->weldVertices(epsilon, smoothNormals);
+	return mesh;
 }
 
 void saveSTL(Shared<TriMesh> mesh, const String& name)
@@ -182,161 +180,8 @@ void saveSTL(Shared<TriMesh> mesh, const String& name)
 	file << *buffer;
 }
 
-// Still only supports OBJs with normals, and with only triangles
-
-Shared<SceneNode> loadOBJ(const asl::String& filename)
+static bool openPPM(File& file, const String& filename, int w, int h)
 {
-	TextFile file(filename, File::READ);
-	if (!file)
-		return NULL;
-
-	Shared<TriMesh> mesh = new TriMesh();
-
-	Dic<Shared<TriMesh>>  meshes;
-	Dic<Shared<Material>> materials;
-
-	materials[""] = new Material;
-	meshes[""] = mesh;
-
-	// one mesh per material
-	// all meshes will share vertices, normals and texcoords
-
-	Array<Vec3> vertices;
-	Array<Vec3> normals;
-	Array<Vec2> texcoords;
-
-	mesh->material = materials[""];
-
-	Array<String> indices;
-	String        line;
-
-	while (!file.end())
-	{
-		file.readLine(line);
-		if (line.startsWith('#'))
-			continue;
-		Array<String> parts = line.split();
-		if (parts.length() == 0)
-			continue;
-		if (parts[0] == 'v')
-		{
-			vertices << Vec3(parts[1], parts[2], parts[3]);
-		}
-		else if (parts[0] == "vn")
-		{
-			normals << Vec3(parts[1], parts[2], parts[3]);
-		}
-		else if (parts[0] == "vt")
-		{
-			texcoords << Vec2(parts[1], 1.0f - (float)parts[2]);
-		}
-		else if (parts[0] == 'f')
-		{
-			for (int i = 1; i < parts.length(); i++)
-			{
-				parts[i].split('/', indices);
-				mesh->indices << (int)indices[0] - 1;
-				if (indices.length() > 1)
-					mesh->texcoordsI << (int)indices[1] - 1;
-				if (indices.length() > 2)
-					mesh->normalsI << (int)indices[2] - 1;
-			}
-#ifdef OBJ_TRI
-			mesh->indices << -1;
-			mesh->texcoordsI << -1;
-			mesh->normalsI << -1;
-#endif
-		}
-		else if (parts[0] == "usemtl")
-		{
-			String& name = parts[1];
-			if (!meshes.has(name))
-			{
-				mesh = new TriMesh;
-				mesh->material = materials.get(name, materials[""]);
-				meshes[name] = mesh;
-			}
-			mesh = meshes[name];
-		}
-		else if (parts[0] == "mtllib")
-		{
-			TextFile         matfile(Path(filename).directory() + "/" + parts[1], File::READ);
-			Shared<Material> mat = materials[""];
-			for (auto line : matfile.lines())
-			{
-				Array<String> parts = line.split();
-				if (parts.length() == 0)
-					continue;
-
-				if (parts[0] == "newmtl")
-				{
-					mat = new Material;
-					materials[parts[1]] = mat;
-				}
-				else if (parts[0] == "Kd")
-					mat->diffuse = Vec3(parts[1], parts[2], parts[3]);
-				else if (parts[0] == "Ks")
-					mat->specular = Vec3(parts[1], parts[2], parts[3]);
-				else if (parts[0] == "Ke")
-					mat->emissive = Vec3(parts[1], parts[2], parts[3]);
-				else if (parts[0] == "Ns")
-				{
-					mat->shininess = parts[1];
-					if (mat->shininess < 0.0001f)
-						mat->shininess = 10;
-				}
-				else if (parts[0] == "d")
-					mat->opacity = parts[1];
-				else if (parts[0] == "map_Kd")
-					mat->textureName = parts[1];
-			}
-		}
-	}
-
-	for (auto mat : materials)
-	{
-		if (mat.value->textureName.ok())
-		{
-			mat.value->texture = loadPPM(Path(filename).directory() + "/" + mat.value->textureName);
-		}
-	}
-
-	Shared<SceneNode> node = new SceneNode;
-	for (auto& e : meshes)
-	{
-		Shared<TriMesh>& mesh = e.value;
-#ifdef OBJ_TRI
-		mesh->indices = triangulateIndices(mesh->indices);
-		mesh->texcoordsI = triangulateIndices(mesh->texcoordsI);
-		mesh->normalsI = triangulateIndices(mesh->normalsI);
-#endif
-		mesh->vertices = vertices;
-		mesh->normals = normals;
-		mesh->texcoords = texcoords;
-		if (!mesh->normals)
-		{
-			mesh->normals.dup();
-			mesh->normalsI.clear();
-			for (int i = 0, j = 0; i < mesh->indices.length(); i += 3, j++)
-			{
-				Vec3 a = mesh->vertices[mesh->indices[i]];
-				Vec3 b = mesh->vertices[mesh->indices[i + 1]];
-				Vec3 c = mesh->vertices[mesh->indices[i + 2]];
-				Vec3 n = ((b - a) ^ (c - a)).normalized();
-				mesh->normals << n;
-				mesh->normalsI << j << j << j;
-			}
-		}
-
-		node->children << mesh;
-	}
-
-	return node;
-}
-
-void savePPM(const Array2<Vec3>& image, const String& filename)
-{
-	File file;
 	if (filename != "--")
 		file.open(filename, File::WRITE);
 	else
@@ -344,11 +189,19 @@ void savePPM(const Array2<Vec3>& image, const String& filename)
 	if (!file)
 	{
 		printf("Cannot write file '%s'\n", *filename);
-		return;
+		return false;
 	}
 	String header;
-	header << "P6\n" << image.cols() << " " << image.rows() << "\n" << 255 << "\n";
+	header << "P6\n" << w << " " << h << "\n" << 255 << "\n";
 	file << header;
+	return true;
+}
+
+void savePPM(const Array2<Vec3>& image, const String& filename)
+{
+	File file;
+	if (!openPPM(file, filename, image.cols(), image.rows()))
+		return;
 	Array<byte> data(image.cols() * 3);
 
 	for (int i = 0; i < image.rows(); i++)
@@ -364,6 +217,26 @@ void savePPM(const Array2<Vec3>& image, const String& filename)
 	}
 }
 
+void savePPM(const Array2<unsigned>& image, const String& filename)
+{
+	File file;
+	if (!openPPM(file, filename, image.cols(), image.rows()))
+		return;
+	Array<byte> data(image.cols() * 3);
+
+	for (int i = 0; i < image.rows(); i++)
+	{
+		const unsigned* row = &image(i, 0);
+		for (int j = 0; j < image.cols(); j++)
+		{
+			data[j * 3] = (byte)row[j];
+			data[j * 3 + 1] = (byte)(row[j] >> 8);
+			data[j * 3 + 2] = (byte)(row[j] >> 16);
+		}
+		file.write(data.ptr(), data.length());
+	}
+}
+
 Array2<Vec3> loadPPM(const String& filename)
 {
 	Array2<Vec3> image;
@@ -414,6 +287,105 @@ Array2<Vec3> loadPPM(const String& filename)
 	return image;
 }
 
+// the texture cache: files by absolute path, with the time (in loads) they were last loaded, to drop the least
+// recently loaded ones first. A file is in use if anything besides the cache references it
+
+namespace
+{
+struct CachedTexture
+{
+	Shared<TextureFile> file;
+	long long lastUse;
+};
+
+struct TextureCache
+{
+	std::mutex mutex;
+	Map<String, CachedTexture> files;
+	long long loads = 0;
+	size_t budget = 0;
+	size_t memory = 0;
+
+	void trim(size_t limit)
+	{
+		while (memory > limit)
+		{
+			String oldest;
+			long long oldestUse = loads + 1;
+			for (auto& e : files)
+				if (e.value.file.refCount() == 1 && e.value.lastUse < oldestUse)
+				{
+					oldest = e.key;
+					oldestUse = e.value.lastUse;
+				}
+			if (oldestUse > loads)
+				break;
+			memory -= files[oldest].file->memory();
+			files.remove(oldest);
+		}
+	}
+};
+
+TextureCache& textureCache()
+{
+	static TextureCache cache;
+	return cache;
+}
+}
+
+Shared<TextureFile> loadTexture(const String& filename)
+{
+	String path = Path(filename).absolute();
+	TextureCache& cache = textureCache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	cache.loads++;
+
+	if (cache.files.has(path))
+	{
+		CachedTexture& cached = cache.files[path];
+		cached.lastUse = cache.loads;
+		return cached.file;
+	}
+
+	Shared<TextureFile> file = new TextureFile;
+	file->path = path;
+	file->image = loadPPM(path);
+	if (file->image.rows() == 0 || file->image.cols() == 0)
+		return Shared<TextureFile>();
+	file->texture = Texture(file->image);
+
+	CachedTexture& cached = cache.files[path];
+	cached.file = file;
+	cached.lastUse = cache.loads;
+	cache.memory += file->memory();
+	if (cache.budget > 0)
+		cache.trim(cache.budget);
+	return file;
+}
+
+void setTextureCacheBudget(size_t bytes)
+{
+	TextureCache& cache = textureCache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	cache.budget = bytes;
+	if (bytes > 0)
+		cache.trim(bytes);
+}
+
+size_t textureCacheMemory()
+{
+	TextureCache& cache = textureCache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	return cache.memory;
+}
+
+void clearTextureCache()
+{
+	TextureCache& cache = textureCache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	cache.trim(0);
+}
+
 void saveXYZ(const Array2<Vec3>& points, const String& filename, const asl::Matrix4& m)
 {
 	TextFile file(filename, File::WRITE);
@@ -0,0 +1,70 @@
+#include "mapped.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace minirender {
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const asl::String& filename) : _data(0), _size(0), _file(INVALID_HANDLE_VALUE), _mapping(0)
+{
+	_file = CreateFileA(*filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (_file == INVALID_HANDLE_VALUE)
+		return;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0)
+		return;
+	_mapping = CreateFileMappingA(_file, 0, PAGE_READONLY, 0, 0, 0);
+	if (!_mapping)
+		return;
+	_data = (const char*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+	if (_data)
+		_size = (size_t)size.QuadPart;
+}
+
+MappedFile::~MappedFile()
+{
+	if (_data)
+		UnmapViewOfFile(_data);
+	if (_mapping)
+		CloseHandle(_mapping);
+	if (_file != INVALID_HANDLE_VALUE)
+		CloseHandle(_file);
+}
+
+#else
+
+MappedFile::MappedFile(const asl::String& filename) : _data(0), _size(0)
+{
+	int fd = open(*filename, O_RDONLY);
+	if (fd < 0)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		void* p = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED)
+		{
+			_data = (const char*)p;
+			_size = (size_t)st.st_size;
+			madvise(p, _size, MADV_WILLNEED); // start reading ahead, as the whole file will be parsed
+		}
+	}
+	close(fd); // the mapping stays valid
+}
+
+MappedFile::~MappedFile()
+{
+	if (_data)
+		munmap((void*)_data, _size);
+}
+
+#endif
+
+}
@@ -0,0 +1,32 @@
+#ifndef MINIRENDER_MAPPED_H
+#define MINIRENDER_MAPPED_H
+
+#include <asl/String.h>
+#include <stddef.h>
+
+namespace minirender {
+
+// A file mapped read-only into memory, so that loaders can parse it in place without reading it into buffers.
+// It is empty (data() null) if the file cannot be opened or mapped, or has no bytes.
+
+class MappedFile
+{
+public:
+	MappedFile(const asl::String& filename);
+	~MappedFile();
+	const char* data() const { return _data; }
+	size_t size() const { return _size; }
+	operator bool() const { return _data != 0; }
+private:
+	MappedFile(const MappedFile&);
+	void operator=(const MappedFile&);
+	const char* _data;
+	size_t _size;
+#ifdef _WIN32
+	void* _file;
+	void* _mapping;
+#endif
+};
+
+}
+#endif
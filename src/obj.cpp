@@ -0,0 +1,311 @@
+#include <asl/TextFile.h>
+#include <asl/Map.h>
+#include <asl/Path.h>
+#include "minirender/io.h"
+#include "mapped.h"
+#include "parallel.h"
+#include "parse.h"
+#include <string.h>
+
+using namespace asl;
+
+namespace minirender
+{
+
+// OBJ files are mapped and split in chunks of whole lines parsed in parallel, each into its own arrays and a list of
+// the usemtl and mtllib commands found (with the face counts at that point). Then the chunks are merged in order,
+// replaying the commands, so the result is the same as parsing sequentially. Polygons are triangulated as fans.
+// Face indices must be positive (absolute)
+
+namespace
+{
+
+inline String parseName(const char*& p, const char* end)
+{
+	skipBlanks(p, end);
+	const char* start = p;
+	while (p < end && !isBlank(*p) && *p != '\n')
+		p++;
+	return String(start, int(p - start));
+}
+
+inline bool keyword(const char* p, const char* end, const char* word, int n)
+{
+	return end - p > n && memcmp(p, word, n) == 0 && isBlank(p[n]);
+}
+
+struct ObjCommand
+{
+	bool material; // usemtl (or mtllib)
+	String name;
+	int indices, texcoordsI, normalsI; // face indices before the command
+};
+
+struct ObjChunk
+{
+	Array<Vec3> vertices, normals;
+	Array<Vec2> texcoords;
+	Array<int> indices, texcoordsI, normalsI;
+	Array<ObjCommand> commands;
+	void parse(const char* p, const char* end);
+};
+
+void ObjChunk::parse(const char* p, const char* end)
+{
+	Array<int> face[3]; // vertex, texcoord and normal indices of a face
+	bool has[3];
+
+	while (p < end)
+	{
+		skipBlanks(p, end);
+		const char* eol = lineEnd(p, end);
+		if (p == eol)
+		{
+			p = eol + 1;
+			continue;
+		}
+		char c = *p;
+		if (c == 'v' && eol - p > 1 && isBlank(p[1]))
+		{
+			p += 2;
+			float x = parseFloat(p, eol), y = parseFloat(p, eol), z = parseFloat(p, eol);
+			vertices << Vec3(x, y, z);
+		}
+		else if (c == 'v' && keyword(p, eol, "vn", 2))
+		{
+			p += 3;
+			float x = parseFloat(p, eol), y = parseFloat(p, eol), z = parseFloat(p, eol);
+			normals << Vec3(x, y, z);
+		}
+		else if (c == 'v' && keyword(p, eol, "vt", 2))
+		{
+			p += 3;
+			float u = parseFloat(p, eol), v = parseFloat(p, eol);
+			texcoords << Vec2(u, 1.0f - v);
+		}
+		else if (c == 'f' && eol - p > 1 && isBlank(p[1]))
+		{
+			p += 2;
+			for (int k = 0; k < 3; k++)
+			{
+				face[k].clear();
+				has[k] = true;
+			}
+			while (true)
+			{
+				skipBlanks(p, eol);
+				if (p >= eol || unsigned(*p - '0') >= 10)
+					break;
+				int index[3] = { parseInt(p, eol), 0, 0 };
+				for (int k = 1; k < 3 && p < eol && *p == '/'; k++)
+				{
+					p++;
+					index[k] = parseInt(p, eol);
+				}
+				for (int k = 0; k < 3; k++)
+				{
+					face[k] << index[k] - 1;
+					has[k] = has[k] && index[k] > 0;
+				}
+			}
+			Array<int>* lists[3] = { &indices, &texcoordsI, &normalsI };
+			for (int k = 0; k < 3; k++)
+			{
+				if (!has[k])
+					continue;
+				for (int j = 1; j + 1 < face[k].length(); j++)
+					*lists[k] << face[k][0] << face[k][j] << face[k][j + 1];
+			}
+		}
+		else if (c == 'u' && keyword(p, eol, "usemtl", 6))
+		{
+			p += 7;
+			ObjCommand command = { true, parseName(p, eol), indices.length(), texcoordsI.length(), normalsI.length() };
+			commands << command;
+		}
+		else if (c == 'm' && keyword(p, eol, "mtllib", 6))
+		{
+			p += 7;
+			ObjCommand command = { false, parseName(p, eol), indices.length(), texcoordsI.length(), normalsI.length() };
+			commands << command;
+		}
+		p = eol + 1;
+	}
+}
+
+template<class T>
+void append(Array<T>& a, const Array<T>& b, int i0, int i1)
+{
+	if (i1 <= i0)
+		return;
+	int n = a.length();
+	a.resize(n + i1 - i0);
+	memcpy(&a[n], &b[i0], (i1 - i0) * sizeof(T));
+}
+
+// concatenates the arrays of all chunks (copying them in parallel)
+template<class T>
+Array<T> concat(const Array<ObjChunk>& chunks, Array<T> ObjChunk::*array)
+{
+	if (chunks.length() == 1)
+		return chunks[0].*array;
+	Array<int> start(chunks.length() + 1);
+	start[0] = 0;
+	for (int k = 0; k < chunks.length(); k++)
+		start[k + 1] = start[k] + (chunks[k].*array).length();
+	Array<T> all(start[chunks.length()]);
+	parallelFor(chunks.length(), hardwareThreads(), [&](int k) {
+		const Array<T>& a = chunks[k].*array;
+		if (a.length() > 0)
+			memcpy(&all[start[k]], &a[0], a.length() * sizeof(T));
+	});
+	return all;
+}
+
+void loadMTL(const String& filename, Dic<Shared<Material>>& materials)
+{
+	TextFile         matfile(filename, File::READ);
+	Shared<Material> mat = materials[""];
+	for (auto line : matfile.lines())
+	{
+		Array<String> parts = line.split();
+		if (parts.length() == 0)
+			continue;
+
+		if (parts[0] == "newmtl")
+		{
+			mat = new Material;
+			materials[parts[1]] = mat;
+		}
+		else if (parts[0] == "Kd")
+			mat->diffuse = Vec3(parts[1], parts[2], parts[3]);
+		else if (parts[0] == "Ks")
+			mat->specular = Vec3(parts[1], parts[2], parts[3]);
+		else if (parts[0] == "Ke")
+			mat->emissive = Vec3(parts[1], parts[2], parts[3]);
+		else if (parts[0] == "Ns")
+		{
+			mat->shininess = parts[1];
+			if (mat->shininess < 0.0001f)
+				mat->shininess = 10;
+		}
+		else if (parts[0] == "d")
+			mat->opacity = parts[1];
+		else if (parts[0] == "map_Kd")
+			mat->textureName = parts[1];
+	}
+}
+
+}
+
+Shared<SceneNode> loadOBJ(const asl::String& filename)
+{
+	const size_t chunkSize = 1 << 22;
+	MappedFile file(filename);
+	if (!file && !File(filename).exists()) // (an empty file cannot be mapped)
+		return NULL;
+
+	Array<const char*> bounds;
+	const char* end = file.data() + file.size();
+	bounds << file.data();
+	while (end - bounds.last() > (ptrdiff_t)chunkSize)
+	{
+		const char* p = bounds.last() + chunkSize;
+		p = (const char*)memchr(p, '\n', end - p);
+		if (!p)
+			break;
+		bounds << p + 1;
+	}
+	bounds << end;
+
+	Array<ObjChunk> chunks(bounds.length() - 1);
+	parallelFor(chunks.length(), hardwareThreads(), [&](int k) { chunks[k].parse(bounds[k], bounds[k + 1]); });
+
+	// one mesh per material
+	// all meshes will share vertices, normals and texcoords
+
+	Dic<Shared<TriMesh>>  meshes;
+	Dic<Shared<Material>> materials;
+
+	Shared<TriMesh> mesh = new TriMesh();
+	materials[""] = new Material;
+	meshes[""] = mesh;
+	mesh->material = materials[""];
+
+	for (auto& chunk : chunks)
+	{
+		int i = 0, it = 0, in = 0;
+		for (int c = 0; c <= chunk.commands.length(); c++)
+		{
+			bool last = c == chunk.commands.length();
+			int i1 = last ? chunk.indices.length() : chunk.commands[c].indices;
+			int it1 = last ? chunk.texcoordsI.length() : chunk.commands[c].texcoordsI;
+			int in1 = last ? chunk.normalsI.length() : chunk.commands[c].normalsI;
+			append(mesh->indices, chunk.indices, i, i1);
+			append(mesh->texcoordsI, chunk.texcoordsI, it, it1);
+			append(mesh->normalsI, chunk.normalsI, in, in1);
+			i = i1;
+			it = it1;
+			in = in1;
+			if (last)
+				break;
+			const ObjCommand& command = chunk.commands[c];
+			if (command.material)
+			{
+				if (!meshes.has(command.name))
+				{
+					mesh = new TriMesh;
+					mesh->material = materials.get(command.name, materials[""]);
+					meshes[command.name] = mesh;
+				}
+				mesh = meshes[command.name];
+			}
+			else
+				loadMTL(Path(filename).directory() + "/" + command.name, materials);
+		}
+	}
+
+	Array<Vec3> vertices = concat(chunks, &ObjChunk::vertices);
+	Array<Vec3> normals = concat(chunks, &ObjChunk::normals);
+	Array<Vec2> texcoords = concat(chunks, &ObjChunk::texcoords);
+	chunks.clear();
+
+	for (auto mat : materials)
+	{
+		if (mat.value->textureName.ok())
+		{
+			mat.value->setTexture(loadTexture(Path(filename).directory() + "/" + mat.value->textureName));
+		}
+	}
+
+	Shared<SceneNode> node = new SceneNode;
+	for (auto& e : meshes)
+	{
+		Shared<TriMesh>& mesh = e.value;
+		mesh->vertices = vertices;
+		mesh->normals = normals;
+		mesh->texcoords = texcoords;
+		if (mesh->texcoordsI.length() != mesh->indices.length()) // some faces without texcoords
+			mesh->texcoordsI.clear();
+		if (!mesh->normals || mesh->normalsI.length() != mesh->indices.length())
+		{
+			mesh->normals = Array<Vec3>();
+			mesh->normalsI.clear();
+			for (int i = 0, j = 0; i < mesh->indices.length(); i += 3, j++)
+			{
+				Vec3 a = mesh->vertices[mesh->indices[i]];
+				Vec3 b = mesh->vertices[mesh->indices[i + 1]];
+				Vec3 c = mesh->vertices[mesh->indices[i + 2]];
+				Vec3 n = ((b - a) ^ (c - a)).normalized();
+				mesh->normals << n;
+				mesh->normalsI << j << j << j;
+			}
+		}
+
+		node->children << mesh;
+	}
+
+	return node;
+}
+
+}
@@ -0,0 +1,116 @@
+#include "parallel.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+
+namespace minirender {
+
+namespace {
+
+thread_local bool insideJob = false;
+
+// A process-wide set of worker threads that sleep until a job is posted. Only one job runs at a time.
+
+struct WorkerPool
+{
+	std::vector<std::thread> threads;
+	std::mutex runMutex;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const std::function<void(int)>* job;
+	std::atomic<int> next;
+	int count;
+	int wanted;
+	int active;
+	unsigned generation;
+	bool quit;
+
+	WorkerPool() : job(0), next(0), count(0), wanted(0), active(0), generation(0), quit(false) {}
+
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (auto& t : threads)
+			t.join();
+	}
+
+	void work()
+	{
+		insideJob = true;
+		for (int i; (i = next++) < count;)
+			(*job)(i);
+		insideJob = false;
+	}
+
+	void loop(int index)
+	{
+		unsigned seen = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return quit || (generation != seen && index < wanted); });
+				if (quit)
+					return;
+				seen = generation;
+			}
+			work();
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--active == 0)
+				done.notify_one();
+		}
+	}
+
+	void run(int n, int nthreads, const std::function<void(int)>& f)
+	{
+		std::lock_guard<std::mutex> runLock(runMutex);
+		int extra = (nthreads < n ? nthreads : n) - 1;
+		while ((int)threads.size() < extra)
+		{
+			int index = (int)threads.size();
+			threads.emplace_back([this, index] { loop(index); });
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &f;
+			count = n;
+			next = 0;
+			wanted = extra;
+			active = extra;
+			generation++;
+		}
+		wake.notify_all();
+		work();
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&] { return active == 0; });
+		job = 0;
+	}
+};
+
+}
+
+int hardwareThreads()
+{
+	int n = (int)std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+void parallelFor(int n, int threads, const std::function<void(int)>& f)
+{
+	if (threads <= 1 || n <= 1 || insideJob)
+	{
+		for (int i = 0; i < n; i++)
+			f(i);
+		return;
+	}
+	static WorkerPool pool;
+	pool.run(n, threads, f);
+}
+
+}
@@ -0,0 +1,16 @@
+#ifndef MINIRENDER_PARALLEL_H
+#define MINIRENDER_PARALLEL_H
+
+#include <functional>
+
+namespace minirender {
+
+// Number of hardware threads available (at least 1)
+int hardwareThreads();
+
+// Calls f(i) for every i in [0, n) using up to `threads` threads (the calling thread included).
+// Items are taken dynamically, so they may run in any order. Calls made from inside a worker run serially.
+void parallelFor(int n, int threads, const std::function<void(int)>& f);
+
+}
+#endif
@@ -0,0 +1,149 @@
+#ifndef MINIRENDER_PARSE_H
+#define MINIRENDER_PARSE_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number parsing for the text loaders, straight from file or attribute text (no strings), and not locale dependent
+
+namespace minirender {
+
+const double powers10[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+inline bool isBlank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline void skipBlanks(const char*& p, const char* end)
+{
+	while (p < end && isBlank(*p))
+		p++;
+}
+
+// blanks, line breaks and commas
+inline bool isSeparator(char c)
+{
+	return isBlank(c) || c == '\n' || c == ',';
+}
+
+inline void skipSeparators(const char*& p, const char* end)
+{
+	while (p < end && isSeparator(*p))
+		p++;
+}
+
+// skips at least one character, up to the next separator
+inline void skipToken(const char*& p, const char* end)
+{
+	do
+		p++;
+	while (p < end && !isSeparator(*p));
+}
+
+inline bool isNumberEnd(char c)
+{
+	return isBlank(c) || c == '\n' || c == ',' || c == '/';
+}
+
+inline const char* lineEnd(const char* p, const char* end)
+{
+	const char* e = (const char*)memchr(p, '\n', end - p);
+	return e ? e : end;
+}
+
+// a decimal number (after blanks) with up to 19 significant digits read exactly and scaled by a power of 10 (exact up
+// to 1e22), else (inf, nan, hex) left to strtod. If there is no number, p is left after the blanks and 0 returned
+inline float parseFloat(const char*& p, const char* end)
+{
+	skipBlanks(p, end);
+	const char* start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+	unsigned long long m = 0;
+	int e = 0, digits = 0;
+	bool any = false;
+	for (; p < end && unsigned(*p - '0') < 10; p++, any = true)
+	{
+		if (digits < 19)
+		{
+			m = m * 10 + (*p - '0');
+			if (m != 0)
+				digits++;
+		}
+		else
+			e++;
+	}
+	if (p < end && *p == '.')
+	{
+		for (p++; p < end && unsigned(*p - '0') < 10; p++, any = true)
+		{
+			if (digits < 19)
+			{
+				m = m * 10 + (*p - '0');
+				e--;
+				if (m != 0)
+					digits++;
+			}
+		}
+	}
+	if (any && p < end && (*p == 'e' || *p == 'E'))
+	{
+		const char* q = p + 1;
+		bool eneg = false;
+		if (q < end && (*q == '-' || *q == '+'))
+			eneg = *q++ == '-';
+		if (q < end && unsigned(*q - '0') < 10)
+		{
+			int x = 0;
+			for (; q < end && unsigned(*q - '0') < 10; q++)
+				if (x < 10000)
+					x = x * 10 + (*q - '0');
+			e += eneg ? -x : x;
+			p = q;
+		}
+	}
+	if (!any || (p < end && !isNumberEnd(*p)))
+	{
+		char text[64];
+		const char* q = start;
+		int n = 0;
+		while (q < end && !isNumberEnd(*q) && n < 63)
+			text[n++] = *q++;
+		text[n] = '\0';
+		char* e;
+		double x = strtod(text, &e);
+		p = start + (e - text);
+		return (float)x;
+	}
+	double x = (double)m;
+	if (e < 0)
+		x = e >= -22 ? x / powers10[-e] : x / pow(10.0, -e);
+	else if (e > 0)
+		x = e <= 22 ? x * powers10[e] : x * pow(10.0, e);
+	return (float)(negative ? -x : x);
+}
+
+// an integer, or 0 with p unchanged if there is none
+inline int parseInt(const char*& p, const char* end)
+{
+	const char* start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+	if (p == end || unsigned(*p - '0') >= 10)
+	{
+		p = start;
+		return 0;
+	}
+	int x = 0;
+	for (; p < end && unsigned(*p - '0') < 10; p++)
+		x = x * 10 + (*p - '0');
+	return negative ? -x : x;
+}
+
+}
+#endif
@@ -0,0 +1,242 @@
+#ifndef MINIRENDER_SIMD_H
+#define MINIRENDER_SIMD_H
+
+// Minimal packets of floats and ints for the rasterizer: 8 lanes with AVX2, 4 with SSE2, a single value otherwise
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+
+namespace minirender {
+namespace simd {
+
+#if SIMD_WIDTH == 8
+
+struct Floats
+{
+	__m256 v;
+	Floats() {}
+	Floats(__m256 x) : v(x) {}
+	Floats(float x) : v(_mm256_set1_ps(x)) {}
+	static Floats ramp() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+	static Floats load(const float* p) { return _mm256_loadu_ps(p); }
+	void store(float* p) const { _mm256_storeu_ps(p, v); }
+	Floats operator+(const Floats& b) const { return _mm256_add_ps(v, b.v); }
+	Floats operator-(const Floats& b) const { return _mm256_sub_ps(v, b.v); }
+	Floats operator*(const Floats& b) const { return _mm256_mul_ps(v, b.v); }
+	Floats operator/(const Floats& b) const { return _mm256_div_ps(v, b.v); }
+	Floats operator&(const Floats& b) const { return _mm256_and_ps(v, b.v); }
+	Floats operator<(const Floats& b) const { return _mm256_cmp_ps(v, b.v, _CMP_LT_OQ); }
+	Floats operator>(const Floats& b) const { return _mm256_cmp_ps(v, b.v, _CMP_GT_OQ); }
+	Floats operator>=(const Floats& b) const { return _mm256_cmp_ps(v, b.v, _CMP_GE_OQ); }
+	int mask() const { return _mm256_movemask_ps(v); }
+};
+
+// ramp(a, d) is a, a + d, a + 2d..., and negative() the mask of the negative lanes. Conversions from floats truncate
+
+struct Ints
+{
+	__m256i v;
+	Ints() {}
+	Ints(__m256i x) : v(x) {}
+	Ints(int x) : v(_mm256_set1_epi32(x)) {}
+	static Ints ramp(int a, int d) { return _mm256_setr_epi32(a, a + d, a + 2 * d, a + 3 * d, a + 4 * d, a + 5 * d, a + 6 * d, a + 7 * d); }
+	static Ints load(const int* p) { return _mm256_loadu_si256((const __m256i*)p); }
+	static Ints convert(const Floats& x) { return _mm256_cvttps_epi32(x.v); }
+	Floats toFloats() const { return _mm256_cvtepi32_ps(v); }
+	void store(int* p) const { _mm256_storeu_si256((__m256i*)p, v); }
+	Ints operator+(const Ints& b) const { return _mm256_add_epi32(v, b.v); }
+	Ints operator-(const Ints& b) const { return _mm256_sub_epi32(v, b.v); }
+	Ints operator|(const Ints& b) const { return _mm256_or_si256(v, b.v); }
+	Ints operator&(const Ints& b) const { return _mm256_and_si256(v, b.v); }
+	Ints operator>>(int n) const { return _mm256_srai_epi32(v, n); }
+	Ints operator<<(int n) const { return _mm256_slli_epi32(v, n); }
+	int negative() const { return _mm256_movemask_ps(_mm256_castsi256_ps(v)); }
+};
+
+inline Floats sqrt(const Floats& a) { return _mm256_sqrt_ps(a.v); }
+inline Floats max(const Floats& a, const Floats& b) { return _mm256_max_ps(a.v, b.v); }
+inline Floats min(const Floats& a, const Floats& b) { return _mm256_min_ps(a.v, b.v); }
+
+inline Floats exp2(const Floats& x0)
+{
+	Floats x = max(min(x0, 129.0f), -126.99999f);
+	__m256i ipart = _mm256_cvtps_epi32((x - 0.5f).v);
+	Floats fpart = x - Floats(_mm256_cvtepi32_ps(ipart));
+	Floats expipart = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(ipart, _mm256_set1_epi32(127)), 23));
+	Floats expfpart = ((((fpart * 1.8775767e-3f + 8.9893397e-3f) * fpart + 5.5826318e-2f) * fpart + 2.4015361e-1f) * fpart +
+	                   6.9315308e-1f) * fpart + 9.9999994e-1f;
+	return expipart * expfpart;
+}
+
+inline Floats log2(const Floats& x)
+{
+	__m256i i = _mm256_castps_si256(x.v);
+	Floats e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(_mm256_and_si256(i, _mm256_set1_epi32(0x7F800000)), 23),
+	                                               _mm256_set1_epi32(127)));
+	Floats m = _mm256_or_ps(_mm256_castsi256_ps(_mm256_and_si256(i, _mm256_set1_epi32(0x007FFFFF))), _mm256_set1_ps(1.0f));
+	Floats p = ((((m * -3.4436006e-2f + 3.1821337e-1f) * m - 1.2315303f) * m + 2.5988452f) * m - 3.3241990f) * m + 3.1157899f;
+	return p * (m - 1.0f) + e;
+}
+
+#elif SIMD_WIDTH == 4
+
+struct Floats
+{
+	__m128 v;
+	Floats() {}
+	Floats(__m128 x) : v(x) {}
+	Floats(float x) : v(_mm_set1_ps(x)) {}
+	static Floats ramp() { return _mm_setr_ps(0, 1, 2, 3); }
+	static Floats load(const float* p) { return _mm_loadu_ps(p); }
+	void store(float* p) const { _mm_storeu_ps(p, v); }
+	Floats operator+(const Floats& b) const { return _mm_add_ps(v, b.v); }
+	Floats operator-(const Floats& b) const { return _mm_sub_ps(v, b.v); }
+	Floats operator*(const Floats& b) const { return _mm_mul_ps(v, b.v); }
+	Floats operator/(const Floats& b) const { return _mm_div_ps(v, b.v); }
+	Floats operator&(const Floats& b) const { return _mm_and_ps(v, b.v); }
+	Floats operator<(const Floats& b) const { return _mm_cmplt_ps(v, b.v); }
+	Floats operator>(const Floats& b) const { return _mm_cmpgt_ps(v, b.v); }
+	Floats operator>=(const Floats& b) const { return _mm_cmpge_ps(v, b.v); }
+	int mask() const { return _mm_movemask_ps(v); }
+};
+
+struct Ints
+{
+	__m128i v;
+	Ints() {}
+	Ints(__m128i x) : v(x) {}
+	Ints(int x) : v(_mm_set1_epi32(x)) {}
+	static Ints ramp(int a, int d) { return _mm_setr_epi32(a, a + d, a + 2 * d, a + 3 * d); }
+	static Ints load(const int* p) { return _mm_loadu_si128((const __m128i*)p); }
+	static Ints convert(const Floats& x) { return _mm_cvttps_epi32(x.v); }
+	Floats toFloats() const { return _mm_cvtepi32_ps(v); }
+	void store(int* p) const { _mm_storeu_si128((__m128i*)p, v); }
+	Ints operator+(const Ints& b) const { return _mm_add_epi32(v, b.v); }
+	Ints operator-(const Ints& b) const { return _mm_sub_epi32(v, b.v); }
+	Ints operator|(const Ints& b) const { return _mm_or_si128(v, b.v); }
+	Ints operator&(const Ints& b) const { return _mm_and_si128(v, b.v); }
+	Ints operator>>(int n) const { return _mm_srai_epi32(v, n); }
+	Ints operator<<(int n) const { return _mm_slli_epi32(v, n); }
+	int negative() const { return _mm_movemask_ps(_mm_castsi128_ps(v)); }
+};
+
+inline Floats sqrt(const Floats& a) { return _mm_sqrt_ps(a.v); }
+inline Floats max(const Floats& a, const Floats& b) { return _mm_max_ps(a.v, b.v); }
+inline Floats min(const Floats& a, const Floats& b) { return _mm_min_ps(a.v, b.v); }
+
+inline Floats exp2(const Floats& x0)
+{
+	Floats x = max(min(x0, 129.0f), -126.99999f);
+	__m128i ipart = _mm_cvtps_epi32((x - 0.5f).v);
+	Floats fpart = x - Floats(_mm_cvtepi32_ps(ipart));
+	Floats expipart = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(ipart, _mm_set1_epi32(127)), 23));
+	Floats expfpart = ((((fpart * 1.8775767e-3f + 8.9893397e-3f) * fpart + 5.5826318e-2f) * fpart + 2.4015361e-1f) * fpart +
+	                   6.9315308e-1f) * fpart + 9.9999994e-1f;
+	return expipart * expfpart;
+}
+
+inline Floats log2(const Floats& x)
+{
+	__m128i i = _mm_castps_si128(x.v);
+	Floats e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(_mm_and_si128(i, _mm_set1_epi32(0x7F800000)), 23), _mm_set1_epi32(127)));
+	Floats m = _mm_or_ps(_mm_castsi128_ps(_mm_and_si128(i, _mm_set1_epi32(0x007FFFFF))), _mm_set1_ps(1.0f));
+	Floats p = ((((m * -3.4436006e-2f + 3.1821337e-1f) * m - 1.2315303f) * m + 2.5988452f) * m - 3.3241990f) * m + 3.1157899f;
+	return p * (m - 1.0f) + e;
+}
+
+#endif
+
+#if SIMD_WIDTH > 1
+
+// x^y for x >= 0 (polynomial approximations of exp2 and log2, relative error around 1e-6)
+
+inline Floats pow(const Floats& x, float y)
+{
+	return exp2(log2(x) * y) & (x > 0.f);
+}
+
+#else
+
+// comparisons give all bits set (true) or zero (false), as SIMD compares do
+
+struct Floats
+{
+	float v;
+	Floats() {}
+	Floats(float x) : v(x) {}
+	static Floats ramp() { return 0.f; }
+	static Floats load(const float* p) { return *p; }
+	static Floats bits(unsigned x) { Floats f; memcpy(&f.v, &x, 4); return f; }
+	unsigned bits() const { unsigned x; memcpy(&x, &v, 4); return x; }
+	void store(float* p) const { *p = v; }
+	Floats operator+(const Floats& b) const { return v + b.v; }
+	Floats operator-(const Floats& b) const { return v - b.v; }
+	Floats operator*(const Floats& b) const { return v * b.v; }
+	Floats operator/(const Floats& b) const { return v / b.v; }
+	Floats operator&(const Floats& b) const { return bits(bits() & b.bits()); }
+	Floats operator<(const Floats& b) const { return bits(v < b.v ? ~0u : 0u); }
+	Floats operator>(const Floats& b) const { return bits(v > b.v ? ~0u : 0u); }
+	Floats operator>=(const Floats& b) const { return bits(v >= b.v ? ~0u : 0u); }
+	int mask() const { return bits() >> 31; }
+};
+
+struct Ints
+{
+	int v;
+	Ints() {}
+	Ints(int x) : v(x) {}
+	static Ints ramp(int a, int) { return a; }
+	static Ints load(const int* p) { return *p; }
+	static Ints convert(const Floats& x) { return (int)x.v; }
+	Floats toFloats() const { return (float)v; }
+	void store(int* p) const { *p = v; }
+	Ints operator+(const Ints& b) const { return v + b.v; }
+	Ints operator-(const Ints& b) const { return v - b.v; }
+	Ints operator|(const Ints& b) const { return v | b.v; }
+	Ints operator&(const Ints& b) const { return v & b.v; }
+	Ints operator>>(int n) const { return v >> n; }
+	Ints operator<<(int n) const { return v << n; }
+	int negative() const { return v < 0 ? 1 : 0; }
+};
+
+inline Floats sqrt(const Floats& a) { return std::sqrt(a.v); }
+inline Floats max(const Floats& a, const Floats& b) { return a.v > b.v ? a : b; }
+inline Floats min(const Floats& a, const Floats& b) { return a.v < b.v ? a : b; }
+inline Floats pow(const Floats& x, float y) { return std::pow(x.v, y); }
+
+#endif
+
+// number of lanes set in a mask
+
+inline int countLanes(int mask)
+{
+	int n = 0;
+	for (; mask; mask &= mask - 1)
+		n++;
+	return n;
+}
+
+// loads the first n values of p (n <= SIMD_WIDTH) without reading past them
+
+inline Floats loadPartial(const float* p, int n)
+{
+	float x[SIMD_WIDTH] = { 0 };
+	for (int i = 0; i < n; i++)
+		x[i] = p[i];
+	return Floats::load(x);
+}
+
+}
+}
+
+#endif
@@ -3,14 +3,54 @@
 #include <asl/Path.h>
 #include <asl/Xml.h>
 #include "minirender/io.h"
+#include "parse.h"
 
 using namespace asl;
 
 namespace minirender
 {
+// numbers of an attribute (separated by spaces, line breaks or commas), parsed in place. Anything else that does not
+// read as a number is skipped up to the next separator
+
+Array<float> parseFloats(const String& s)
+{
+	Array<float> a;
+	a.reserve(s.length() / 8);
+	const char* p = *s;
+	const char* end = p + s.length();
+	for (skipSeparators(p, end); p < end; skipSeparators(p, end))
+	{
+		const char* start = p;
+		float x = parseFloat(p, end);
+		if (p == start)
+			skipToken(p, end);
+		else
+			a << x;
+	}
+	return a;
+}
+
+Array<int> parseInts(const String& s)
+{
+	Array<int> a;
+	a.reserve(s.length() / 4);
+	const char* p = *s;
+	const char* end = p + s.length();
+	for (skipSeparators(p, end); p < end; skipSeparators(p, end))
+	{
+		const char* start = p;
+		int x = parseInt(p, end);
+		if (p == start)
+			skipToken(p, end);
+		else
+			a << x;
+	}
+	return a;
+}
+
 inline Vec3 toVec3(const String& s)
 {
-	auto a = s.split_<float>().resize(3);
+	auto a = parseFloats(s).resize(3);
 	return Vec3(a[0], a[1], a[2]);
 }
 
@@ -34,135 +74,257 @@ Array<int> triangulateIndices(const Array<int>& indices)
 
 struct X3dReader
 {
-	String filename;
-	Xml    x3d;
+	String   filename;
+	Xml      x3d;
+	Dic<Xml> defs; // elements by DEF name (the first one if repeated)
+
+	// what was built for each DEF, shared by all its USEs (instancing): nodes, materials of appearances and of
+	// Material nodes (with the texture), geometries (meshes without material), points of Coordinate nodes, and shapes
+	// by geometry and appearance. A USE before its DEF builds it from the index, and the DEF then finds it here
+	Dic<Shared<SceneNode>> nodes;
+	Dic<Shared<Material>>  materials;
+	Dic<Shared<Material>>  materialNodes;
+	Dic<Shared<TriMesh>>   geometries;
+	Dic<Array<Vec3>>       coordinates;
+	Dic<Shared<TriMesh>>   shapes;
 
 	Shared<SceneNode> getSceneItem(Xml& e);
+	Shared<SceneNode> buildSceneItem(Xml& e);
+	Shared<Material>  getMaterial(const Xml& appearance);
+	Shared<TriMesh>   getGeometry(const Xml& geometry);
+	Array<Vec3>       getCoordinates(const Xml& coordinate);
 	Shared<SceneNode> load(const asl::String& filename);
+	void              indexDefs(const Xml& e);
+	static String     defName(const Xml& e) { return e.has("USE") ? e["USE"] : e["DEF"]; }
 	Xml        get(const Xml& item) const
 	{
 		if (item.has("USE"))
-		{
-			String use = item["USE"];
-			return x3d.findOne([=](const Xml& e) { return e["DEF"] == use; });
-		}
+			return defs.get(item["USE"], Xml());
 		else
 			return item;
 	}
 };
 
-Shared<SceneNode> X3dReader::getSceneItem(Xml& e)
+void X3dReader::indexDefs(const Xml& e)
 {
-	Shared<SceneNode> node;
-	if (e.tag() == "Transform" || e.tag() == "Group")
+	if (e.has("DEF"))
 	{
-		auto rotation = (e["rotation"] | "0 0 1 0").split();
-		auto translation = (e["translation"] | "0 0 0").split();
-		auto scale = (e["scale"] | "1 1 1").split();
-		node = new SceneNode;
-		node->transform = Matrix4::translate(translation[0], translation[1], translation[2]) *
-		                  Matrix4::rotate(Vec3(rotation[0], rotation[1], rotation[2]), rotation[3]) *
-		                  Matrix4::scale(Vec3(scale[0], scale[1], scale[2]));
+		String def = e["DEF"];
+		if (!defs.has(def))
+			defs[def] = e;
+	}
+	for (auto& child : e.children())
+		indexDefs(child);
+}
 
-		for (auto& child : e.children())
+// a USE is the same node as its DEF, a child of several parents. A DEF being built is null in `nodes`, so a USE inside
+// it (a node containing itself) is skipped
+
+Shared<SceneNode> X3dReader::getSceneItem(Xml& e)
+{
+	if (e.has("USE"))
+	{
+		String use = e["USE"];
+		if (!nodes.has(use))
 		{
-			auto n = getSceneItem(child);
-			if (n)
-				node->children << n;
+			Xml def = get(e);
+			nodes[use] = def ? getSceneItem(def) : Shared<SceneNode>();
 		}
-
-		return node;
+		return nodes[use];
 	}
-	else if (e.tag() == "Shape")
+
+	if (!e.has("DEF"))
+		return buildSceneItem(e);
+
+	String def = e["DEF"];
+	if (nodes.has(def)) // already built for a USE before it, or a repeated DEF
+		return nodes[def];
+	nodes[def] = Shared<SceneNode>();
+	Shared<SceneNode> node = buildSceneItem(e);
+	nodes[def] = node;
+	return node;
+}
+
+Shared<Material> X3dReader::getMaterial(const Xml& appearance)
+{
+	String name = defName(appearance);
+	if (name.ok() && materials.has(name))
+		return materials[name];
+
+	// different appearances with the same DEF'd Material node and texture also share the material
+	Xml    appx = get(appearance);
+	Xml    tex = get(appx("ImageTexture"));
+	String textureName = tex ? Path(tex["url"]).noExt() + ".ppm" : String();
+	String matName = defName(appx("Material"));
+	String key = matName + "\n" + textureName;
+	if (matName.ok() && materialNodes.has(key))
 	{
-		TriMesh* mesh = new TriMesh;
-		auto     appx = get(e("Appearance"));
+		if (name.ok())
+			materials[name] = materialNodes[key];
+		return materialNodes[key];
+	}
 
-		mesh->material = new Material;
+	Shared<Material> material = new Material;
 
-		if (Xml mat = get(appx("Material")))
-		{
-			mesh->material->diffuse = toVec3(mat["diffuseColor"] | "0.7 0.75 0.8");
-			mesh->material->specular = toVec3(mat["specularColor"] | "0.4 0.4 0.4");
-			mesh->material->emissive = toVec3(mat["emissiveColor"] | "0 0 0");
-			mesh->material->shininess = float(mat["shininess"] | "0.5") * 8;
-		}
+	if (Xml mat = get(appx("Material")))
+	{
+		material->diffuse = toVec3(mat["diffuseColor"] | "0.7 0.75 0.8");
+		material->specular = toVec3(mat["specularColor"] | "0.4 0.4 0.4");
+		material->emissive = toVec3(mat["emissiveColor"] | "0 0 0");
+		material->shininess = float(mat["shininess"] | "0.5") * 8;
+	}
 
-		if (Xml tex = get(appx("ImageTexture")))
+	if (tex)
+	{
+		material->textureName = textureName;
+		if (material->textureName.ok())
 		{
-			String path = tex["url"];
-			mesh->material->textureName = Path(path).noExt() + ".ppm";
-			if (mesh->material->textureName.ok())
-			{
-				mesh->material->texture = loadPPM(Path(filename).directory() + "/" + mesh->material->textureName);
-			}
+			material->setTexture(loadTexture(Path(filename).directory() + "/" + material->textureName));
 		}
+	}
 
-		Xml ifs = get(e("IndexedFaceSet"));
-		Xml its = get(e("IndexedTriangleSet"));
+	if (name.ok())
+		materials[name] = material;
+	if (matName.ok())
+		materialNodes[key] = material;
+	return material;
+}
 
-		if (Xml g = ifs ? ifs : its)
-		{
-			Array<float> verts = get(g("Coordinate"))["point"].replace(',', ' ').split_<float>();
-			Array<float> normals = get(g("Normal"))["vector"].replace(',', ' ').split_<float>();
-			Array<float> uvs = get(g("TextureCoordinate"))["point"].replace(',', ' ').split_<float>();
+Array<Vec3> X3dReader::getCoordinates(const Xml& coordinate)
+{
+	String name = defName(coordinate);
+	if (name.ok() && coordinates.has(name))
+		return coordinates[name];
+
+	Array<float> points = parseFloats(get(coordinate)["point"]);
+	Array<Vec3>  vertices;
+	vertices.reserve(points.length() / 3);
+	for (int i = 0; i + 2 < points.length(); i += 3)
+		vertices << Vec3(points[i], points[i + 1], points[i + 2]);
+
+	if (name.ok())
+		coordinates[name] = vertices;
+	return vertices;
+}
 
-			mesh->vertices.reserve(verts.length() / 3);
-			mesh->normals.reserve(normals.length() / 3);
-			mesh->texcoords.reserve(uvs.length() / 2);
+Shared<TriMesh> X3dReader::getGeometry(const Xml& geometry)
+{
+	String name = defName(geometry);
+	if (name.ok() && geometries.has(name))
+		return geometries[name];
 
-			for (int i = 0; i < verts.length(); i += 3)
-				mesh->vertices << Vec3(verts[i], verts[i + 1], verts[i + 2]);
+	Shared<TriMesh> mesh = new TriMesh;
+	Xml             g = get(geometry);
 
-			for (int i = 0; i < normals.length(); i += 3)
-				mesh->normals << Vec3(normals[i], normals[i + 1], normals[i + 2]);
+	if (g)
+	{
+		Array<float> normals = parseFloats(get(g("Normal"))["vector"]);
+		Array<float> uvs = parseFloats(get(g("TextureCoordinate"))["point"]);
 
-			for (int i = 0; i < uvs.length(); i += 2)
-				mesh->texcoords << Vec2(uvs[i], 1 - uvs[i + 1]);
+		mesh->vertices = getCoordinates(g("Coordinate"));
+		mesh->normals.reserve(normals.length() / 3);
+		mesh->texcoords.reserve(uvs.length() / 2);
 
-			if (ifs)
-			{
-				mesh->indices = g["coordIndex"].split_<int>();
-				mesh->texcoordsI = g["texCoordIndex"].split();
-				mesh->normalsI = g["normalIndex"].split();
+		for (int i = 0; i < normals.length(); i += 3)
+			mesh->normals << Vec3(normals[i], normals[i + 1], normals[i + 2]);
 
-				mesh->indices = triangulateIndices(mesh->indices);
-				mesh->texcoordsI = !mesh->texcoordsI ? mesh->indices.clone() : triangulateIndices(mesh->texcoordsI);
-				mesh->normalsI = !mesh->normalsI ? mesh->indices.clone() : triangulateIndices(mesh->normalsI);
-			}
-			else
-			{
-				mesh->indices = g["index"].split_<int>();
-				mesh->texcoordsI = mesh->indices.clone();
-				mesh->normalsI = mesh->indices.clone();
-			}
+		for (int i = 0; i < uvs.length(); i += 2)
+			mesh->texcoords << Vec2(uvs[i], 1 - uvs[i + 1]);
 
-			if (!mesh->normals)
-			{
-				mesh->normalsI.clear();
-				for (int i = 0, j = 0; i < mesh->indices.length(); i += 3, j++)
-				{
-					Vec3 a = mesh->vertices[mesh->indices[i]];
-					Vec3 b = mesh->vertices[mesh->indices[i + 1]];
-					Vec3 c = mesh->vertices[mesh->indices[i + 2]];
-					Vec3 n = ((b - a) ^ (c - a)).normalized();
-					mesh->normals << n;
-					mesh->normalsI << j << j << j;
-				}
-			}
+		if (g.tag() == "IndexedFaceSet")
+		{
+			mesh->indices = parseInts(g["coordIndex"]);
+			mesh->texcoordsI = parseInts(g["texCoordIndex"]);
+			mesh->normalsI = parseInts(g["normalIndex"]);
+
+			mesh->indices = triangulateIndices(mesh->indices);
+			mesh->texcoordsI = !mesh->texcoordsI ? mesh->indices.clone() : triangulateIndices(mesh->texcoordsI);
+			mesh->normalsI = !mesh->normalsI ? mesh->indices.clone() : triangulateIndices(mesh->normalsI);
+		}
+		else
+		{
+			mesh->indices = parseInts(g["index"]);
+			mesh->texcoordsI = mesh->indices.clone();
+			mesh->normalsI = mesh->indices.clone();
+		}
 
-			if (!mesh->texcoords)
+		if (!mesh->normals)
+		{
+			mesh->normalsI.clear();
+			for (int i = 0, j = 0; i < mesh->indices.length(); i += 3, j++)
 			{
-				mesh->texcoords << Vec2(0, 0);
-				mesh->texcoordsI = Array<int>(mesh->indices.length(), 0);
+				Vec3 a = mesh->vertices[mesh->indices[i]];
+				Vec3 b = mesh->vertices[mesh->indices[i + 1]];
+				Vec3 c = mesh->vertices[mesh->indices[i + 2]];
+				Vec3 n = ((b - a) ^ (c - a)).normalized();
+				mesh->normals << n;
+				mesh->normalsI << j << j << j;
 			}
 		}
 
+		if (!mesh->texcoords)
+		{
+			mesh->texcoords << Vec2(0, 0);
+			mesh->texcoordsI = Array<int>(mesh->indices.length(), 0);
+		}
+	}
+
+	if (name.ok())
+		geometries[name] = mesh;
+	return mesh;
+}
+
+Shared<SceneNode> X3dReader::buildSceneItem(Xml& e)
+{
+	Shared<SceneNode> node;
+	if (e.tag() == "Transform" || e.tag() == "Group")
+	{
+		auto rotation = parseFloats(e["rotation"] | "0 0 1 0").resize(4);
+		auto translation = parseFloats(e["translation"] | "0 0 0").resize(3);
+		auto scale = parseFloats(e["scale"] | "1 1 1").resize(3);
+		node = new SceneNode;
+		node->transform = Matrix4::translate(translation[0], translation[1], translation[2]) *
+		                  Matrix4::rotate(Vec3(rotation[0], rotation[1], rotation[2]), rotation[3]) *
+		                  Matrix4::scale(Vec3(scale[0], scale[1], scale[2]));
+
+		for (auto& child : e.children())
+		{
+			auto n = getSceneItem(child);
+			if (n)
+				node->children << n;
+		}
+
+		return node;
+	}
+	else if (e.tag() == "Shape")
+	{
+		// shapes with the same DEF'd geometry and appearance are one mesh; others share the geometry arrays
+
+		Xml    appearance = e("Appearance");
+		Xml    geometry = e("IndexedFaceSet") ? e("IndexedFaceSet") : e("IndexedTriangleSet");
+		String key = defName(geometry) + "\n" + defName(appearance);
+		bool   shared = defName(geometry).ok() && defName(appearance).ok();
+
+		if (shared && shapes.has(key))
+			return shapes[key];
+
+		Shared<TriMesh> geo = getGeometry(geometry);
+		Shared<TriMesh> mesh = new TriMesh;
+		mesh->vertices = geo->vertices;
+		mesh->normals = geo->normals;
+		mesh->texcoords = geo->texcoords;
+		mesh->indices = geo->indices;
+		mesh->normalsI = geo->normalsI;
+		mesh->texcoordsI = geo->texcoordsI;
+		mesh->material = getMaterial(appearance);
+
+		if (shared)
+			shapes[key] = mesh;
 		return mesh;
 	}
 	else if (e.tag() == "Inline")
 	{
-		return load(Path(filename).directory() + "/" + e["url"].replace("\"", ""));
+		return X3dReader().load(Path(filename).directory() + "/" + e["url"].replace("\"", ""));
 	}
 
 	return NULL;
@@ -183,6 +345,7 @@ Shared<SceneNode> X3dReader::load(const asl::String& filename)
 	Shared<SceneNode> root = new SceneNode();
 
 	this->filename = filename;
+	indexDefs(x3d);
 
 	for (auto& e : scene.children())
 	{